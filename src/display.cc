@@ -15,6 +15,7 @@
 
 #include "display.h"
 #include "font.h"
+#include "modem.h"
 #include "storage.h"
 #include "system.h"
 
@@ -25,12 +26,17 @@ extern System rocket;
 
 Display::Display()
 {
-	char_pos = -1;
+	planes = 1;
+	brightness = DISPLAY_MAX_BRIGHTNESS;
+	plane_ocr = 255;
 }
 
 void Display::disable()
 {
-	TIMSK0 &= ~_BV(TOIE0);
+	TIMSK0 &= ~(_BV(OCIE0A) | _BV(OCIE0B));
+#ifdef DISPLAY_CLOCK
+	TIMSK1 &= ~_BV(OCIE1B);
+#endif
 	PORTB = 0;
 	PORTD = 0;
 }
@@ -41,25 +47,77 @@ void Display::enable()
 	DDRB = 0xff;
 	DDRD = 0xff;
 
-	// Enable 8bit counter with prescaler=8 (-> timer frequency = 1MHz)
-	TCCR0A = _BV(CS01);
-	// raise timer interrupt on counter overflow (-> interrupt frequency = ~4kHz)
-	TIMSK0 = _BV(TOIE0);
+	// Enable 8bit counter with prescaler=8 (-> timer frequency = 1MHz),
+	// cleared on compare match so that multiplex() can set its period
+	TCCR0A = _BV(CTC0) | _BV(CS01);
+	OCR0A = plane_ocr;
+	// raise timer interrupt on compare match (-> interrupt frequency = ~4kHz)
+	TIMSK0 = _BV(OCIE0A);
+	// and on compare match B to blank the column for brightness < 100%
+	if (brightness < DISPLAY_MAX_BRIGHTNESS)
+		TIMSK0 |= _BV(OCIE0B);
+
+#ifdef DISPLAY_CLOCK
+	setClock();
+#endif
 }
 
+#ifdef DISPLAY_CLOCK
+void Display::setClock()
+{
+	uint8_t sreg = SREG;
+
+	// 16 bit registers share a temporary register with the modem ISRs
+	cli();
+	if (step_ms && (TIMSK0 & _BV(OCIE0A))) {
+		// Timer1 (started by the modem) compare match B -> animation clock
+		if (!(TIMSK1 & _BV(OCIE1B))) {
+			OCR1B = TCNT1 + (MODEM_TIMER1_HZ / 1000);
+			TIFR1 = _BV(OCF1B);
+		}
+		TIMSK1 |= _BV(OCIE1B);
+	} else {
+		TIMSK1 &= ~_BV(OCIE1B);
+	}
+	SREG = sreg;
+}
+#endif
+
 void Display::multiplex()
 {
+	uint8_t col = disp_buf[(active_plane << 3) | active_col];
+
+	/*
+	 * The timer has just been cleared. Set the period of the plane which
+	 * is about to be shown before the counter reaches the new value, it
+	 * may be as short as 36 microseconds. Each plane lasts twice as long
+	 * as the one before it.
+	 */
+	if (active_plane == 0) {
+		OCR0A = plane_ocr;
+		OCR0B = plane_ocrb;
+	} else {
+		OCR0A = (OCR0A << 1) | 1;
+		OCR0B <<= 1;
+	}
+	// drop a blanking request for the previous column which came too late
+	TIFR0 = _BV(OCF0B);
+
 	/*
 	 * To avoid flickering, do not put any code (or expensive index
 	 * calculations) between the following three lines.
 	 */
 	PORTB = 0;
-	PORTD = disp_buf[active_col];
+	PORTD = col;
 	PORTB = _BV(active_col);
 
+	if (++active_plane < planes)
+		return;
+	active_plane = 0;
+
 	if (++active_col == 8) {
 		active_col = 0;
-		if (++update_cnt == update_threshold) {
+		if (update_threshold && (++update_cnt == update_threshold)) {
 			update_cnt = 0;
 			need_update = 1;
 		}
@@ -67,140 +125,160 @@ void Display::multiplex()
 }
 
 void Display::update() {
-	uint8_t i, glyph_len;
-	uint8_t *glyph_addr;
+	uint8_t i, mask;
+	uint8_t chunk_len;
+
+	/*
+	 * update() is called much more often than a scroll step is due, so
+	 * the next character is ready long before its first column is needed
+	 */
+	if ((col_len == 0) && (status == RUNNING))
+		renderColumns();
+
 	if (need_update) {
 		need_update = 0;
 
+		/*
+		 * Animations up to 128 bytes are held completely in
+		 * current_anim->data, longer ones are handled in 64 byte chunks
+		 */
+		chunk_len = (current_anim->length > 128) ? 64 : 128;
+
 		if (status == RUNNING) {
 			if (current_anim->type == AnimationType::TEXT) {
 
 				/*
-				 * Scroll display contents to the left/right
+				 * Scroll display contents to the left/right and append
+				 * the next column of the current character
 				 */
 				if (current_anim->direction == 0) {
 					for (i = 0; i < 7; i++) {
 						disp_buf[i] = disp_buf[i+1];
 					}
+					disp_buf[7] = disp_buf[8 + col_pos];
 				} else if (current_anim->direction == 1) {
 					for (i = 7; i > 0; i--) {
 						disp_buf[i] = disp_buf[i-1];
 					}
+					disp_buf[0] = disp_buf[8 + col_pos];
 				}
 
 				/*
-				 * Load current character
+				 * The whitespace column after a character moves on to
+				 * the next one. Every glyph has at least one column, so
+				 * col_len == 1 only holds for the whitespace before the
+				 * first character.
 				 */
-				glyph_addr = (uint8_t *)pgm_read_ptr(&font[current_anim->data[str_pos]]);
-				glyph_len = pgm_read_byte(&glyph_addr[0]);
-				char_pos++;
-
-				if (char_pos > glyph_len) {
-					char_pos = 0;
-					if (current_anim->direction == 0)
-						str_pos++;
-					else
-						str_pos--; // may underflow, but that's okay
+				if (++col_pos == col_len) {
+					if (col_len > 1) {
+						if (current_anim->direction == 0)
+							str_pos++;
+						else
+							str_pos--; // may underflow, but that's okay
+					}
+					col_len = 0;
 				}
 
+			} else if (current_anim->type == AnimationType::FRAMES) {
 				/*
-				 * Append one character column (or whitespace if we are
-				 * between two characters)
+				 * Three-plane frames (24 bytes) may cross the end of
+				 * a chunk. The rest of the frame is in the other half
+				 * of current_anim->data, which holds the next chunk.
 				 */
-				if (current_anim->direction == 0) {
-					if (char_pos == 0) {
-						disp_buf[7] = 0xff; // whitespace
-					} else {
-						disp_buf[7] = ~pgm_read_byte(&glyph_addr[char_pos]);
-					}
-				} else {
-					if (char_pos == 0) {
-						disp_buf[0] = 0xff; // whitespace
-					} else {
-						disp_buf[0] = ~pgm_read_byte(&glyph_addr[glyph_len - char_pos + 1]);
-					}
+				for (i = 0; i < planes * 8; i++) {
+					disp_buf[i] = ~current_anim->data[(uint8_t)(str_pos + i) & 127];
 				}
-
-			} else if (current_anim->type == AnimationType::FRAMES) {
+				str_pos += planes * 8;
+			} else if (current_anim->type == AnimationType::DELTA) {
+				/*
+				 * The first frame is relative to a blank display, the
+				 * last one may still be shown when the animation starts
+				 * over. Like three-plane frames, delta frames may cross
+				 * the end of a chunk. disp_buf is inverted, but
+				 * ~(a ^ b) == ~a ^ b.
+				 */
+				if ((str_chunk == 0) && (str_pos == chunk_base)) {
+					for (i = 0; i < 8; i++)
+						disp_buf[i] = 0xff;
+				}
+				mask = current_anim->data[str_pos++ & 127];
 				for (i = 0; i < 8; i++) {
-					disp_buf[i] = ~current_anim->data[str_pos+i];
+					if (mask & _BV(i))
+						disp_buf[i] ^= current_anim->data[str_pos++ & 127];
 				}
-				str_pos += 8;
 			}
 
 			if (current_anim->direction == 0) {
 				/*
 				 * Check whether we reached the end of the pattern
-				 * (that is, we're in the last chunk and reached the
-				 * remaining pattern length)
+				 * (that is, the position in the complete animation
+				 * reached the pattern length)
 				 */
-				if ((str_chunk == ((current_anim->length - 1) / 128))
-						&& (str_pos > ((current_anim->length - 1) % 128))) {
-					str_chunk = 0;
-					str_pos = 0;
-
-
-					if (current_anim->delay > 0) {
-						status = PAUSED;
-						update_threshold = 244;
-					}
+				if ((uint16_t)(str_chunk * chunk_len + (uint8_t)(str_pos - chunk_base))
+						>= current_anim->length) {
+					/*
+					 * For patterns longer than 128 bytes, the first chunk
+					 * has been prefetched into the other half -- unless
+					 * the last frame crossed into the last chunk, which
+					 * is then held by the other half instead
+					 */
 					if (current_anim->length > 128) {
-						storage.loadChunk(str_chunk, current_anim->data);
-					}
-
-					if (current_anim->repeat) {
-						if (++repeat_cnt == current_anim->repeat) { 
-							rocket.current_anim_no = (rocket.current_anim_no + 1) % storage.numPatterns();
-							rocket.loadPattern(rocket.current_anim_no);
-						}
+						chunk_base ^= 64;
+						if (str_chunk != last_chunk)
+							storage.loadChunk(0, current_anim->data + chunk_base);
+						str_chunk = 0;
+						prefetch(1);
 					}
+					str_pos = chunk_base;
+					patternEnd();
 				/*
 				 * Otherwise, check whether the pattern is split into
-				 * several chunks and we reached the end of the chunk
-				 * kept in current_anim->data
+				 * several chunks and we reached the end of the active
+				 * chunk. The next one is already waiting in the other
+				 * half of current_anim->data.
 				 */
-				} else if ((current_anim->length > 128) && (str_pos >= 128)) {
-					str_pos = 0;
+				} else if ((current_anim->length > 128) && ((uint8_t)(str_pos - chunk_base) >= 64)) {
+					i = str_pos - chunk_base - 64;
+					chunk_base ^= 64;
+					str_pos = chunk_base + i;
 					str_chunk++;
-					storage.loadChunk(str_chunk, current_anim->data);
+					if (str_chunk == last_chunk)
+						prefetch(0);
+					else
+						prefetch(str_chunk + 1);
 				}
 			} else {
 				/*
 				 * In this branch we keep doing str_pos--, so check for
-				 * underflow
+				 * underflow (i.e., str_pos left the active chunk)
 				 */
-				if (str_pos >= 128) {
+				if ((uint8_t)(str_pos - chunk_base) >= chunk_len) {
 					/*
 					 * Check whether we reached the end of the pattern
-					 * (and whether we need to load a new chunk)
+					 * (and whether we need to switch to the last chunk)
 					 */
 					if (str_chunk == 0) {
 						if (current_anim->length > 128) {
-							str_chunk = (current_anim->length - 1) / 128;
-							storage.loadChunk(str_chunk, current_anim->data);
-						}
-						if (current_anim->delay > 0) {
-							str_pos = 0;
-							status = PAUSED;
-							update_threshold = 244;
-						} else {
-							str_pos = (current_anim->length - 1) % 128;
-						}
-						if (current_anim->repeat) {
-							if (++repeat_cnt == current_anim->repeat) { 
-								rocket.current_anim_no = (rocket.current_anim_no + 1) % storage.numPatterns();
-								rocket.loadPattern(rocket.current_anim_no);
-							}
+							str_chunk = last_chunk;
+							chunk_base ^= 64;
+							prefetch(str_chunk - 1);
 						}
-
+						str_pos = chunk_base + ((current_anim->length - 1) & (chunk_len - 1));
+						patternEnd();
 
 					/*
-					 * Otherwise, we reached the end of the active chunk
+					 * Otherwise, we reached the start of the active chunk.
+					 * The previous one is already waiting in the other half
+					 * of current_anim->data.
 					 */
 					} else {
 						str_chunk--;
-						storage.loadChunk(str_chunk, current_anim->data);
-						str_pos = 127;
+						chunk_base ^= 64;
+						str_pos = chunk_base + 63;
+						if (str_chunk == 0)
+							prefetch(last_chunk);
+						else
+							prefetch(str_chunk - 1);
 					}
 				}
 			}
@@ -208,11 +286,9 @@ void Display::update() {
 			str_pos++;
 			if (str_pos >= current_anim->delay) {
 				if (current_anim->direction == 0)
-					str_pos = 0;
-				else if (current_anim->length <= 128)
-					str_pos = current_anim->length - 1;
+					str_pos = chunk_base;
 				else
-					str_pos = (current_anim->length - 1) % 128;
+					str_pos = chunk_base + ((current_anim->length - 1) & (chunk_len - 1));
 				status = RUNNING;
 				update_threshold = current_anim->speed;
 			}
@@ -220,15 +296,33 @@ void Display::update() {
 	}
 }
 
+void Display::patternEnd()
+{
+	if (current_anim->delay > 0) {
+		str_pos = 0;
+		status = PAUSED;
+		update_threshold = 244;
+	}
+
+	if (current_anim->repeat) {
+		if (++repeat_cnt == current_anim->repeat) { 
+			rocket.loadPattern((rocket.current_anim_no + 1) % storage.numPatterns());
+		}
+	}
+}
+
 void Display::reset()
 {
-	for (uint8_t i = 0; i < 8; i++)
+	for (uint8_t i = 0; i < sizeof(disp_buf); i++)
 		disp_buf[i] = 0xff;
 	update_cnt = 0;
 	repeat_cnt = 0;
 	str_pos = 0;
 	str_chunk = 0;
-	char_pos = -1;
+	chunk_base = 0;
+	disp_buf[8] = 0xff; // whitespace before the first character
+	col_pos = 0;
+	col_len = 1;
 	need_update = 1;
 	status = RUNNING;
 }
@@ -237,22 +331,117 @@ void Display::show(animation_t *anim)
 {
 	current_anim = anim;
 	reset();
+	planes = current_anim->planes;
+	setTiming();
+#ifdef DISPLAY_CLOCK
+	step_ms = current_anim->step_ms;
+	step_cnt = 0;
+	setClock();
+#endif
 	update_threshold = current_anim->speed;
+	last_chunk = (current_anim->length - 1) / 64;
 	if (current_anim->direction == 1) {
 		if (current_anim->length > 128) {
-			str_chunk = (current_anim->length - 1) / 128;
-			storage.loadChunk(str_chunk, current_anim->data);
+			str_chunk = last_chunk;
+			storage.loadChunk(str_chunk - 1, current_anim->data);
+			storage.loadChunk(str_chunk, current_anim->data + 64);
+			storage.waitChunk();
+			chunk_base = 64;
+			str_pos = 64 + ((current_anim->length - 1) & 63);
+		} else {
+			str_pos = current_anim->length - 1;
 		}
-		str_pos = (current_anim->length - 1) % 128;
 	}
 }
 
+#ifdef DISPLAY_CLOCK
+void Display::tick()
+{
+	if (step_ms && (status == RUNNING) && (++step_cnt >= step_ms)) {
+		step_cnt = 0;
+		need_update = 1;
+	}
+}
+#endif
+
+void Display::renderColumns()
+{
+	uint8_t *glyph_addr = (uint8_t *)pgm_read_ptr(&font[current_anim->data[str_pos]]);
+	uint8_t glyph_len = pgm_read_byte(&glyph_addr[0]);
+
+	for (uint8_t i = 0; i < glyph_len; i++) {
+		if (current_anim->direction == 0)
+			disp_buf[8 + i] = ~pgm_read_byte(&glyph_addr[i + 1]);
+		else
+			disp_buf[8 + i] = ~pgm_read_byte(&glyph_addr[glyph_len - i]);
+	}
+	disp_buf[8 + glyph_len] = 0xff; // whitespace
+	col_pos = 0;
+	col_len = glyph_len + 1;
+}
+
+void Display::setBrightness(uint8_t level)
+{
+	if (!level || (level > DISPLAY_MAX_BRIGHTNESS))
+		level = DISPLAY_MAX_BRIGHTNESS;
+	brightness = level;
+	setTiming();
+
+	if (brightness == DISPLAY_MAX_BRIGHTNESS)
+		TIMSK0 &= ~_BV(OCIE0B);
+	else if (TIMSK0 & _BV(OCIE0A))
+		TIMSK0 |= _BV(OCIE0B);
+}
+
+void Display::setTiming()
+{
+	uint8_t ocrb;
+
+	/*
+	 * The later planes double both values, so the minimum on-time of
+	 * plane 0 keeps the 1:2:4 brightness ratio of the planes
+	 */
+	plane_ocr = (256 / ((1 << planes) - 1)) - 1;
+	ocrb = ((plane_ocr + 1) * brightness) / DISPLAY_MAX_BRIGHTNESS;
+	plane_ocrb = (ocrb < DISPLAY_MIN_ON_TIME) ? DISPLAY_MIN_ON_TIME : ocrb;
+}
+
+void Display::prefetch(uint8_t chunk)
+{
+	storage.loadChunk(chunk, current_anim->data + (chunk_base ^ 64));
+}
+
 /*
  * Current configuration:
  * One interrupt per 256 microseconds. The whole display is refreshed every
- * 2048us, giving a refresh rate of ~500Hz
+ * 2048us, giving a refresh rate of ~500Hz. Grayscale animations use
+ * 2 or 3 interrupts per 252 .. 255 microseconds, the shortest period
+ * (36 microseconds for 3 bit planes) must fit the interrupt latency and
+ * the first half of multiplex().
  */
-ISR(TIMER0_OVF_vect)
+ISR(TIMER0_COMPA_vect)
 {
 	display.multiplex();
 }
+
+/*
+ * Only enabled for brightness < 100%: turns off the active column before the
+ * end of its period.
+ */
+ISR(TIMER0_COMPB_vect)
+{
+	PORTB = 0;
+}
+
+#ifdef DISPLAY_CLOCK
+/*
+ * One interrupt per millisecond while an animation with a step interval is
+ * shown (see Display::setClock()). Timer1 keeps running freely for the
+ * modem, so the next compare value is set relative to the last one.
+ */
+ISR(TIMER1_COMPB_vect)
+{
+	OCR1B += MODEM_TIMER1_HZ / 1000;
+	display.tick();
+}
+#endif
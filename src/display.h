@@ -11,15 +11,57 @@
 #include <avr/io.h>
 #include <stdlib.h>
 
+/**
+ * Maximum number of brightness bits per pixel (bit planes per frame) of
+ * a grayscale FRAMES animation. The shortest plane lasts 256 / (2^planes - 1)
+ * microseconds, which must clearly exceed the worst-case interrupt latency
+ * (ADC and TWI interrupts): 36us with 3 planes, but only 17us with 4.
+ */
+#define DISPLAY_MAX_PLANES 3
+
+/**
+ * Brightness levels are given in eighths of the column time, so
+ * DISPLAY_MAX_BRIGHTNESS is 100% (the column is never blanked).
+ */
+#define DISPLAY_MAX_BRIGHTNESS 8
+
+/**
+ * Minimum OCR0B value. multiplex() sets OCR0B a few microseconds after the
+ * timer has been cleared, a lower compare value would already have passed
+ * and the column would stay on for its whole period.
+ */
+#define DISPLAY_MIN_ON_TIME 8
+
+/**
+ * Size of the TEXT column buffer: the widest glyph in font.h (7 columns)
+ * plus the whitespace column after it. It is kept in the second bit plane of
+ * Display::disp_buf, which TEXT animations do not use.
+ */
+#define DISPLAY_COLUMN_BUF 8
+
+#if DISPLAY_COLUMN_BUF > 8 * (DISPLAY_MAX_PLANES - 1)
+#error "The TEXT column buffer does not fit into the unused bit planes"
+#endif
+
 /**
  * Describes the type of an animation object. The Storage class reserves four
  * bits for the animation type, so up to 16 types are supported.
  */
 enum class AnimationType : uint8_t {
 	TEXT = 1,
-	FRAMES = 2
+	FRAMES = 2,
+	DELTA = 3
 };
 
+/**
+ * Flag in the four type bits of a stored pattern: the first two data bytes
+ * are extended metadata (the step interval in milliseconds, big endian)
+ * instead of animation data, see animation::step_ms. The millisecond clock
+ * is only built with DISPLAY_CLOCK (Makefile: CLOCK=1), otherwise the step
+ * interval is rounded to display refreshes (see System::loadPattern_buf()).
+ */
+#define ANIMATION_EXTMETA 0x08
+
 /**
  * Generic struct for anything which can be displayed, e.g. texts or
  * sequences of frames.
@@ -39,10 +81,11 @@ struct animation {
 	 * For length <= 128, the whole animation is stored in data and
 	 * Display::update() simply traverses the data array.
 	 *
-	 * For length > 128, only up to 128 bytes of animation data are stored
-	 * in data. When Display::update() reaches the end of the array, it will
-	 * use Storage::loadChunk() to load the next 128 byte chunk of animation
-	 * data into the data array.
+	 * For length > 128, data holds two 64 byte chunks of animation data.
+	 * While Display::update() traverses one of them, it uses
+	 * Storage::loadChunk() to load the chunk after it (or before it,
+	 * depending on direction) into the other half of the array in the
+	 * background.
 	 */
 	uint16_t length;
 
@@ -67,12 +110,34 @@ struct animation {
 	 */
 	uint8_t repeat;
 
+	/**
+	 * Number of brightness bits per pixel, 1 .. DISPLAY_MAX_PLANES.
+	 * Must be set to 1 if type != FRAMES. For planes > 1, each frame
+	 * consists of planes groups of eight column bytes (bit planes), the
+	 * least significant one first.
+	 */
+	uint8_t planes;
+
+#ifdef DISPLAY_CLOCK
+	/**
+	 * Interval between two scroll steps / frames in milliseconds, timed
+	 * by Timer1 independently of the display refresh. 0 means that
+	 * speed (counted in display refreshes) is used instead.
+	 */
+	uint16_t step_ms;
+#endif
+
 	/**
 	 * * If type == AnimationType::TEXT: pointer to an arary containing the
 	 *   animation text in standard ASCII format (+ special font chars)
 	 * * If type == AnimationType::FRAMES: Frame array. Each element encodes
 	 *   a display column (starting with the leftmost one), each group of
 	 *   eight elements is a frame.
+	 * * If type == AnimationType::DELTA: Frame array like FRAMES, but each
+	 *   frame is stored as the difference to the previous one (the first
+	 *   one as the difference to a blank display): a mask byte with bit n
+	 *   set for every column n which changes, followed by one byte per set
+	 *   bit (lowest column first) which is XORed into that column.
 	 *
 	 * The data array must always hold at least 128 elements.
 	 */
@@ -113,21 +178,85 @@ class Display {
 		 */
 		uint8_t update_threshold;
 
+#ifdef DISPLAY_CLOCK
+		/**
+		 * Copy of current_anim->step_ms for tick(). If it is nonzero,
+		 * update_threshold is 0 while the animation is running.
+		 */
+		uint16_t step_ms;
+
+		/**
+		 * Milliseconds since the last scroll step / frame, counted by
+		 * tick()
+		 */
+		uint16_t step_cnt;
+#endif
+
 		/**
 		 * The currently active column in multiplex()
 		 */
 		uint8_t active_col;
 
 		/**
-		 * The current display content which multiplex() will show
+		 * The currently active bit plane of active_col in multiplex()
+		 */
+		uint8_t active_plane;
+
+		/**
+		 * Number of bit planes shown by multiplex(), copied from
+		 * current_anim->planes by show()
 		 */
-		uint8_t disp_buf[8];
+		uint8_t planes;
+
+		/**
+		 * OCR0A value of bit plane 0. Plane n is shown 2^n times as
+		 * long as plane 0 (multiplex() doubles the period for each
+		 * plane), and all planes of a column add up to ~256
+		 * microseconds. Set by show().
+		 */
+		uint8_t plane_ocr;
+
+		/**
+		 * OCR0B value of bit plane 0: the timer tick at which
+		 * TIMER0_COMPB_vect blanks the column, doubled for each
+		 * following plane like plane_ocr. Only used if
+		 * brightness < DISPLAY_MAX_BRIGHTNESS.
+		 */
+		uint8_t plane_ocrb;
+
+		/**
+		 * Display brightness in eighths of the column time,
+		 * 1 .. DISPLAY_MAX_BRIGHTNESS
+		 */
+		uint8_t brightness;
+
+		/**
+		 * Calculates plane_ocr and plane_ocrb from planes and brightness.
+		 */
+		void setTiming(void);
+
+#ifdef DISPLAY_CLOCK
+		/**
+		 * Enables the millisecond animation clock (Timer1 compare match
+		 * B, see tick()) while the display is on and step_ms is nonzero,
+		 * disables it otherwise.
+		 */
+		void setClock(void);
+#endif
+
+		/**
+		 * The current display content which multiplex() will show.
+		 * disp_buf[8 * n + col] holds bit plane n of column col, only
+		 * the first eight bytes are used for monochrome patterns.
+		 * For TEXT, disp_buf[8 ..] holds the column buffer instead.
+		 */
+		uint8_t disp_buf[8 * DISPLAY_MAX_PLANES];
 
 		/**
 		 * The current position inside current_anim->data. For a TEXT
 		 * animation, this indicates the currently active character.
 		 * In case of FRAMES, it indicates the leftmost column of an
-		 * eight-column frame.
+		 * eight-column frame, for DELTA the mask byte of the next frame.
 		 *
 		 * This variable is also used as delay counter for status == PAUSED,
 		 * so it must be re-initialized when the pause is over.
@@ -137,28 +266,71 @@ class Display {
 		/**
 		 * The currently active animation chunk. For an animation which is
 		 * not longer than 128 bytes, this will always read 0. Otherwise,
-		 * it indicates the offset in 128 byte-chunks from the start of the
-		 * animation which is currently held in memory. So, str_chunk == 1
-		 * means current->anim_data contains animation bytes 129 to 256,
-		 * and so on. The current position in the complete animation is
-		 * str_chunk * 128 + str_pos.
+		 * it indicates the offset in 64 byte-chunks from the start of the
+		 * animation of the chunk str_pos points to. So, str_chunk == 2
+		 * means animation bytes 128 to 191, and so on. The current position
+		 * in the complete animation is
+		 * str_chunk * 64 + str_pos - chunk_base.
 		 */
 		uint8_t str_chunk;
 
 		/**
-		 * If current_anim->type == TEXT: The column of the character
-		 * pointed to by str_pos which was last added to the display.
-		 *
-		 * For current_anim->direction == 0, this refers to the character's
-		 * left border and counts from 0 onwards. so char_pos == 0 means the
-		 * leftmost column of the character was last added to the display.
+		 * Start of the active chunk inside current_anim->data (0 or 64).
+		 * The other half of current_anim->data holds (or is being loaded
+		 * with) the next chunk (direction == 0) or the previous chunk
+		 * (direction == 1), wrapping around at the start/end of the
+		 * animation. Always 0 for animations up to 128 bytes.
+		 */
+		uint8_t chunk_base;
+
+		/**
+		 * Number of the last 64 byte chunk of current_anim, i.e.
+		 * (current_anim->length - 1) / 64. Set by show().
+		 */
+		uint8_t last_chunk;
+
+		/**
+		 * Starts loading the given chunk into the inactive half of
+		 * current_anim->data.
 		 *
-		 * For current_anim->direction == 1, this refers to the character's
-		 * right border and also counts from 0 onwards, so char_pos == 0
-		 * means the rightmost column of the character was last added to the
-		 * display.
+		 * @param chunk 64 byte-offset inside the animation
+		 */
+		void prefetch(uint8_t chunk);
+
+		/*
+		 * If current_anim->type == TEXT, disp_buf[8 ..] (the column
+		 * buffer) holds the columns of the character pointed to by
+		 * str_pos in the order in which they are added to the display
+		 * (that is, right to left for direction == 1), already inverted
+		 * and followed by a whitespace column. After reset(), it holds
+		 * only the whitespace column before the first character.
+		 */
+
+		/**
+		 * Index of the next column buffer element to add to the display
+		 */
+		uint8_t col_pos;
+
+		/**
+		 * Number of valid elements in the column buffer. 0 means that the
+		 * character at str_pos still needs to be rendered by
+		 * renderColumns().
+		 */
+		uint8_t col_len;
+
+		/**
+		 * Renders the character at str_pos into the column buffer. Called by
+		 * update() between scroll steps, so that a scroll step only
+		 * needs to copy one column.
 		 */
-		int8_t char_pos;
+		void renderColumns(void);
+
+		/**
+		 * Called by update() when the end of the pattern is reached.
+		 * Starts the delay, if any, and advances to the next pattern
+		 * after the configured number of repetitions.
+		 */
+		void patternEnd(void);
 
 		/**
 		 * Internal repeat counter (for autoskip function). 
@@ -197,11 +369,45 @@ class Display {
 
 		/**
 		 * Draws a single display column. Called every 256 microseconds
-		 * by the timer interrupt (TIMER0_OVF_vect), resulting in
-		 * a display refresh rate of ~500Hz (one refresh per 2048µs)
+		 * by the timer interrupt (TIMER0_COMPA_vect), resulting in
+		 * a display refresh rate of ~500Hz (one refresh per 2048µs).
+		 *
+		 * For grayscale animations (binary code modulation), each column
+		 * is drawn once per bit plane and the timer period is set so that
+		 * plane n stays on twice as long as plane n-1. The column time
+		 * and thus the refresh rate stay the same, but the interrupt
+		 * rate grows to up to DISPLAY_MAX_PLANES per column.
+		 *
+		 * If the brightness is reduced, TIMER0_COMPB_vect turns the
+		 * column off again after brightness/8 of its period.
 		 */
 		void multiplex(void);
 
+#ifdef DISPLAY_CLOCK
+		/**
+		 * Animation clock, called every millisecond by the Timer1
+		 * compare B interrupt (TIMER1_COMPB_vect). Requests an update
+		 * every step_ms milliseconds for animations with a step
+		 * interval.
+		 */
+		void tick(void);
+#endif
+
+		/**
+		 * Sets the display brightness (duty cycle). Lower values
+		 * save battery.
+		 *
+		 * @param level on-time of each column in eighths of its period,
+		 *        1 .. DISPLAY_MAX_BRIGHTNESS. Other values select
+		 *        DISPLAY_MAX_BRIGHTNESS.
+		 */
+		void setBrightness(uint8_t level);
+
+		/**
+		 * @return current brightness level, see setBrightness()
+		 */
+		uint8_t getBrightness(void) { return brightness; }
+
 		/**
 		 * Reset display and animation state. Fills the screen with "black"
 		 * (that is, no active pixels) and sets the animation offset to zero.
@@ -211,20 +417,22 @@ class Display {
 		/**
 		 * Update display content.
 		 * Checks current_anim->speed and current_anim->type and scrolls
-		 * the text / advances a frame when appropriate. Also uses
-		 * Storage::loadChunk() to load the next 128 pattern bytes if
-		 * current_anim->length is greater than 128 and the end of the
-		 * 128 byte pattern buffer is reached.
+		 * the text / advances a frame when appropriate. Renders the next
+		 * text character into the column buffer if it is empty. If
+		 * current_anim->length is greater than 128, it switches to the
+		 * other half of the pattern buffer when the end of the active
+		 * chunk is reached, and uses Storage::loadChunk() to prefetch the
+		 * following chunk.
 		 */
 		void update(void);
 
 		/**
 		 * Sets the active animation to be shown on the display. Automatically
 		 * calls reset(). If direction == 1, uses Storage::loadChunk() to
-		 * load the last 128 byte-chunk of anim (so that the text can start
-		 * scrolling from its last position). If direction == 0, the first
-		 * 128 bytes of animation data are expected to already be present in
-		 * anim->data.
+		 * load the last two 64 byte-chunks of anim (so that the text can
+		 * start scrolling from its last position). If direction == 0, the
+		 * first 128 bytes of animation data are expected to already be
+		 * present in anim->data.
 		 *
 		 * @param anim active animation. Note that the data is not copied,
 		 *        so anim has to be kept in memory until a new one is loaded
@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include "fecmodem.h"
 
+#ifndef FEC_RS
+
 uint8_t FECModem::parity128(uint8_t byte)
 {
 	return pgm_read_byte(&hammingParityLow[byte & 0x0f]) ^ pgm_read_byte(&hammingParityHigh[byte >> 4]);
@@ -58,39 +60,193 @@ uint8_t FECModem::hamming2416(uint8_t *byte1, uint8_t *byte2, uint8_t parity)
 	return 0;
 }
 
+bool FECModem::isMarker()
+{
+	/*
+	 * Frame markers are transmitted as the first two bytes of a triple,
+	 * see MessageSpecification.md
+	 */
+	static const uint8_t markers[] PROGMEM = {
+		0xa5, 0xa5, // START
+		0xa5, 0x5a, // START
+#ifdef FEC_INTERLEAVED
+		0xa5, 0x5b, // START (interleaved)
+#endif
+		0x0f, 0xf0, // PATTERN
+		0x84, 0x84, // END
+		0xc3, 0x3c, // CAROUSEL
+	};
+	uint8_t i;
+
+	if (parity2416(triple[0], triple[1]) != triple[2])
+		return false;
+
+	for (i = 0; i < sizeof(markers); i += 2) {
+		if ((triple[0] == pgm_read_byte(&markers[i]))
+				&& (triple[1] == pgm_read_byte(&markers[i+1])))
+			return true;
+	}
+	return false;
+}
+
+#ifdef FEC_INTERLEAVED
+void FECModem::decodeInterleaved()
+{
+	uint8_t i, mask, raw;
+
+	// A block cut short by the end of the transmission is dropped
+	if (this->Modem::buffer_available() < FEC_BLOCK_SIZE) {
+		if (transmissionEnded())
+			this->Modem::buffer_clear();
+		return;
+	}
+
+	// Gather codeword block_word, see comment on block_word in fecmodem.h
+	raw = block_word >> 3;
+	mask = _BV(block_word & 0x07);
+	triple[0] = triple[1] = triple[2] = 0;
+
+	for (i = 0; i < 24; i++) {
+		if (!(*buffer_at(raw + 2 * i) & mask))
+			continue;
+		if (i < 16)
+			triple[i & 1] |= _BV(i >> 1);
+		else
+			triple[2] |= _BV(((i >> 1) & 0x03) | ((i & 1) << 2));
+	}
+
+	i = hamming2416(&triple[0], &triple[1], triple[2]);
+#ifdef FEC_STATS
+	count_errors(i);
+#endif
+	pending = 2;
+
+	if (++block_word == FEC_BLOCK_WORDS) {
+		block_word = 0;
+		buffer_skip(FEC_BLOCK_SIZE);
+	}
+}
+#endif
+
+void FECModem::decode()
+{
+	uint8_t errors;
+
+#ifdef FEC_INTERLEAVED
+	if (interleaved) {
+		decodeInterleaved();
+		return;
+	}
+#endif
+
+	if (hunting) {
+		do {
+			if (!this->Modem::buffer_available())
+				return;
+			triple[0] = triple[1];
+			triple[1] = triple[2];
+			triple[2] = this->Modem::buffer_get();
+		} while (!isMarker());
+
+		hunting = false;
+		resync = true;
+		error_score = 0;
+	} else {
+		if (this->Modem::buffer_available() < 3)
+			return;
+
+		triple[0] = this->Modem::buffer_get();
+		triple[1] = this->Modem::buffer_get();
+		triple[2] = this->Modem::buffer_get();
+
+		errors = hamming2416(&triple[0], &triple[1], triple[2]);
+#ifdef FEC_STATS
+		count_errors(errors);
+#endif
+
+		if (errors >= 3) {
+			error_score += FEC_SCORE_UNCORRECTABLE;
+		} else if (errors) {
+			error_score += FEC_SCORE_CORRECTED;
+		} else if (error_score) {
+			error_score--;
+		}
+
+		if (error_score >= FEC_SCORE_HUNT) {
+			// The triple is most likely misaligned, hunt for the next marker
+			hunting = true;
+			return;
+		}
+	}
+
+#ifdef FEC_INTERLEAVED
+	// The rest of the transmission is interleaved
+	if ((triple[0] == 0xa5) && (triple[1] == 0x5b)) {
+		interleaved = true;
+		block_word = 0;
+	}
+#endif
+
+	pending = 2;
+}
+
 void FECModem::enable()
 {
 	this->Modem::enable();
-	hammingState = FIRST_BYTE;
+	pending = 0;
+	error_score = 0;
+	hunting = false;
+	resync = false;
+#ifdef FEC_INTERLEAVED
+	interleaved = false;
+#endif
 }
 
 uint8_t FECModem::buffer_available()
 {
-//   XXX this reset implementation is _completely_ broken
-//	if (newTransmission())
-//		hammingState = FIRST_BYTE;
-	if (this->Modem::buffer_available() >= 3)
-		return 2;
-	if (hammingState == SECOND_BYTE)
-		return 1;
-	return 0;
+	/*
+	 * Once all raw bytes of a transmission have been read and decoded,
+	 * the next raw byte starts a new triple. Decoded bytes which were not
+	 * read yet still belong to the previous transmission.
+	 */
+	if (pending == 0) {
+		if (newTransmission()) {
+			error_score = 0;
+			hunting = false;
+#ifdef FEC_INTERLEAVED
+			interleaved = false;
+#endif
+		}
+		decode();
+	}
+	return pending;
 }
 
-uint8_t FECModem::buffer_get()
+void FECModem::buffer_clear()
 {
-	uint8_t byte1, parity;
-	if (hammingState == SECOND_BYTE) {
-		hammingState = FIRST_BYTE;
-		return buf_byte;
-	}
-	hammingState = SECOND_BYTE;
-	byte1 = this->Modem::buffer_get();
-	buf_byte = this->Modem::buffer_get();
-	parity = this->Modem::buffer_get();
+	pending = 0;
+#ifdef FEC_INTERLEAVED
+	block_word = 0;
+#endif
+	this->Modem::buffer_clear();
+}
 
-	hamming2416(&byte1, &buf_byte, parity);
+uint8_t FECModem::buffer_get()
+{
+	if (buffer_available() == 0)
+		return 0;
+	return triple[2 - pending--];
+}
 
-	return byte1;
+bool FECModem::resynchronized()
+{
+	if (resync) {
+		resync = false;
+		return true;
+	}
+	return false;
 }
 
 FECModem modem;
+
+#endif /* !FEC_RS */
@@ -15,30 +15,182 @@
 #define FECMODEM_H_
 
 #include "hamming.h"
+#include "reedsolomon.h"
 #include "modem.h"
 
+/*
+ * Error score (see FECModem::error_score) at which the Hamming grouping is
+ * considered lost. A burst error of up to 12 raw bytes touches at most five
+ * triples and stays below FEC_SCORE_HUNT, while the garbage after a byte
+ * slip adds about 1.7 per triple and reaches it within ten triples.
+ */
+#define FEC_SCORE_CORRECTED	1
+#define FEC_SCORE_UNCORRECTABLE	3
+#define FEC_SCORE_HUNT		16
+
+/*
+ * Interleaved mode (make INTERLEAVED=1, FEC_INTERLEAVED): 32 data bytes
+ * (16 Hamming 2416 codewords) are transmitted as one bit-interleaved block
+ * of 48 raw bytes
+ */
+#define FEC_BLOCK_WORDS		16
+#define FEC_BLOCK_SIZE		(FEC_BLOCK_WORDS * 3)
+
 /**
  * Receive-only modem with forward error correction.
  * Uses the Modem class to read raw modem data and uses the Hamming 2416
- * algorithm to detect and, if possible, correct transmission errors.
+ * algorithm (or, if compiled with FEC_RS, Reed-Solomon RS(36, 32), see
+ * fecmodem_rs.cc) to detect and, if possible, correct transmission errors.
  * Exposes a global modem object for convenience.
  */
 class FECModem : public Modem {
 	private:
-		enum HammingState : uint8_t {
-			FIRST_BYTE,
-			SECOND_BYTE
-		};
-		HammingState hammingState;
-		uint8_t buf_byte;
+#ifdef FEC_RS
+		/**
+		 * Number of decoded bytes of the current block which were not
+		 * yet returned by buffer_get() (0 .. 32). The block (32 data
+		 * bytes followed by 4 parity bytes) is corrected in place in
+		 * the Modem buffer and consumed once all of them were read.
+		 */
+		uint8_t pending;
+
+		/**
+		 * True until the first non-zero byte (that is, the end of the
+		 * calibration preamble) of a transmission has been received.
+		 */
+		bool preamble;
+
+		/**
+		 * Set when an uncorrectable block was dropped, see
+		 * resynchronized()
+		 */
+		bool resync;
+
+		/**
+		 * True after an uncorrectable block until the end of the
+		 * transmission. The following block boundaries are unknown,
+		 * so the rest of the transmission is dropped.
+		 */
+		bool dropping;
+
+		/**
+		 * Corrects up to two byte errors in the block at the start of
+		 * the Modem buffer.
+		 * @return number of corrected errors, 3 if uncorrectable
+		 */
+		uint8_t rsCorrect(void);
+
+		/**
+		 * Processes raw bytes from the Modem buffer until a block has
+		 * been decoded or no more raw bytes are available.
+		 */
+		void decode(void);
+#else
+		/**
+		 * Current Hamming 2416 triple (data, data, parity). While
+		 * hunting, this is a sliding window over the raw byte stream.
+		 */
+		uint8_t triple[3];
+
+		/**
+		 * Number of decoded bytes in triple which were not yet returned
+		 * by buffer_get() (0 .. 2)
+		 */
+		uint8_t pending;
+
+		/**
+		 * Recent error history. Increased by FEC_SCORE_CORRECTED for a
+		 * corrected and FEC_SCORE_UNCORRECTABLE for an uncorrectable
+		 * triple, decreased by one for every error-free triple. A single
+		 * burst error only causes a short rise, while a byte slip at the
+		 * Modem layer (which turns every following triple into garbage)
+		 * quickly pushes it beyond FEC_SCORE_HUNT.
+		 */
+		uint8_t error_score;
+
+		/**
+		 * True while searching for a frame marker in the raw byte stream
+		 * to re-align the Hamming grouping.
+		 */
+		bool hunting;
+
+		/**
+		 * Set when the grouping was re-aligned at a frame marker,
+		 * see resynchronized()
+		 */
+		bool resync;
+
+#ifdef FEC_INTERLEAVED
+		/**
+		 * True if the current transmission uses interleaved mode, that
+		 * is, a START marker with BYTE_START2_INTERLEAVED was received.
+		 * Reset at the end of the transmission.
+		 */
+		bool interleaved;
+
+		/**
+		 * Interleaved mode: next codeword to decode from the raw block
+		 * at the start of the Modem buffer, which is consumed after its
+		 * last codeword. Bit n of codeword i (0 .. 15) is raw bit
+		 * 16 * n + i, that is, bit (i % 8) of byte 2 * n + i / 8.
+		 * Codeword bits 0 .. 23 are first data bit 0, second data bit 0,
+		 * first data bit 1, ..., second data bit 7, parity bit 0, 4, 1, 5,
+		 * 2, 6, 3, 7. So, consecutive raw bits belong to different
+		 * codewords and a burst error of up to 32 bits affects each
+		 * Hamming 128 half-codeword at most once.
+		 */
+		uint8_t block_word;
+#endif
 
 		uint8_t parity128(uint8_t byte);
 		uint8_t parity2416(uint8_t byte1, uint8_t byte2);
 		uint8_t correct128(uint8_t *byte, uint8_t parity);
 		uint8_t hamming2416(uint8_t *byte1, uint8_t *byte2, uint8_t parity);
+
+		/**
+		 * Checks whether triple holds a frame marker (see
+		 * MessageSpecification.md) with correct parity.
+		 */
+		bool isMarker(void);
+
+		/**
+		 * Processes raw bytes from the Modem buffer until a triple has
+		 * been decoded or no more raw bytes are available.
+		 */
+		void decode(void);
+
+#ifdef FEC_INTERLEAVED
+		/**
+		 * Interleaved mode variant of decode()
+		 */
+		void decodeInterleaved(void);
+#endif
+#endif
+#ifdef FEC_STATS
+		/**
+		 * Updates the statistics with the return value of
+		 * hamming2416() or rsCorrect(): each uncorrectable Hamming 128
+		 * half-codeword (or RS block) adds 3, each corrected one 1.
+		 */
+		void count_errors(uint8_t errors)
+		{
+			stats_uncorrectable += errors / 3;
+			stats_corrected += errors % 3;
+		};
+#endif
 	public:
 		FECModem() : Modem() {};
 
+#ifdef FEC_STATS
+		/**
+		 * Number of codewords with corrected errors and number of
+		 * uncorrectable codewords. Only used by the host benches, see
+		 * utilities/host.
+		 */
+		uint16_t stats_corrected;
+		uint16_t stats_uncorrectable;
+#endif
+
 		/**
 		 * Enable the modem. Resets the internal Hamming state and calls
 		 * Modem::enable().
@@ -54,12 +206,32 @@ class FECModem : public Modem {
 		 */
 		uint8_t buffer_available(void);
 
+		/**
+		 * Discard all unprocessed bytes in the receive buffer, including
+		 * decoded ones which were not read yet (see
+		 * Modem::buffer_clear()).
+		 */
+		void buffer_clear(void);
+
 		/**
 		 * Get next byte from the receive buffer.
 		 * @return received byte (0 if it contained uncorrectable errors
 		 *         or the buffer is empty)
 		 */
 		uint8_t buffer_get(void);
+
+		/**
+		 * Checks whether the Hamming grouping was lost and re-aligned at a
+		 * frame marker since the last call to this function. If that is
+		 * the case, the data returned by buffer_get() since the last call
+		 * may have been garbage and the next byte is the first byte of a
+		 * START, PATTERN, END or CAROUSEL marker. With FEC_RS, true if an
+		 * uncorrectable block was dropped instead of being returned by
+		 * buffer_get(). The rest of the transmission is dropped as well,
+		 * the next byte is the first one of the next transmission.
+		 * @return true if the receiver re-synchronized
+		 */
+		bool resynchronized(void);
 };
 
 extern FECModem modem;
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2016 by Birte Kristina Friesel
+ *
+ * License: You may use, redistribute and/or modify this file under the terms
+ * of either:
+ * * The GNU LGPL v3 (see COPYING and COPYING.LESSER), or
+ * * The 3-clause BSD License (see COPYING.BSD)
+ *
+ */
+
+#include <avr/io.h>
+#include <stdlib.h>
+#include "fecmodem.h"
+
+#ifdef FEC_RS
+
+/*
+ * a * x and a / x (x = a^1), the primitive element
+ */
+static inline uint8_t gfMulX(uint8_t a)
+{
+	return (a & 0x80) ? (a << 1) ^ 0x1d : a << 1;
+}
+
+static inline uint8_t gfDivX(uint8_t a)
+{
+	return (a & 0x01) ? ((a ^ 0x1d) >> 1) | 0x80 : a >> 1;
+}
+
+#ifdef FEC_RS_TABLES
+
+static uint8_t gfMul(uint8_t a, uint8_t b)
+{
+	uint16_t l;
+
+	if (!a || !b)
+		return 0;
+	l = pgm_read_byte(&gfLog[a]) + pgm_read_byte(&gfLog[b]);
+	if (l >= 255)
+		l -= 255;
+	return pgm_read_byte(&gfExp[l]);
+}
+
+static uint8_t gfDiv(uint8_t a, uint8_t b)
+{
+	int16_t l;
+
+	if (!a || !b)
+		return 0;
+	l = pgm_read_byte(&gfLog[a]) - pgm_read_byte(&gfLog[b]);
+	if (l < 0)
+		l += 255;
+	return pgm_read_byte(&gfExp[l]);
+}
+
+#else
+
+/*
+ * Shift-and-add multiplication, 8 iterations at most. Slower than the
+ * lookup tables, but rsCorrect() only multiplies arbitrary values when a
+ * block has errors.
+ */
+static uint8_t gfMul(uint8_t a, uint8_t b)
+{
+	uint8_t product = 0;
+
+	while (b) {
+		if (b & 1)
+			product ^= a;
+		a = gfMulX(a);
+		b >>= 1;
+	}
+	return product;
+}
+
+/*
+ * a / b = a * b^254 = a * b^2 * b^4 * ... * b^128
+ */
+static uint8_t gfDiv(uint8_t a, uint8_t b)
+{
+	uint8_t i;
+
+	for (i = 0; i < 7; i++) {
+		b = gfMul(b, b);
+		a = gfMul(a, b);
+	}
+	return a;
+}
+
+#endif /* FEC_RS_TABLES */
+
+uint8_t FECModem::rsCorrect()
+{
+	uint8_t syndrome[RS_PARITY_LEN];
+	uint8_t i, j, n, x, xinv, value, det, lambda1, lambda2, omega1, len;
+	uint8_t found = 0;
+	bool error = false;
+
+	/*
+	 * Syndromes S_j = r(a^j). Byte k of the block is the coefficient of
+	 * x^(35 - k).
+	 */
+	for (j = 0, x = 1; j < RS_PARITY_LEN; j++, x = gfMulX(x)) {
+		value = 0;
+		for (i = 0; i < RS_BLOCK_LEN; i++)
+			value = gfMul(value, x) ^ *buffer_at(i);
+		syndrome[j] = value;
+		if (value)
+			error = true;
+	}
+
+	if (!error)
+		return 0;
+
+	/*
+	 * Error locator lambda(x) = 1 + lambda1 x + lambda2 x^2 (Peterson's
+	 * algorithm, which is short for two errors): S_2 = lambda1 S_1 +
+	 * lambda2 S_0 and S_3 = lambda1 S_2 + lambda2 S_1. If these equations
+	 * are singular, there can only be a single error, with S_1 = lambda1
+	 * S_0 and so on.
+	 */
+	det = gfMul(syndrome[1], syndrome[1]) ^ gfMul(syndrome[0], syndrome[2]);
+	if (det) {
+		lambda1 = gfDiv(gfMul(syndrome[1], syndrome[2]) ^ gfMul(syndrome[0], syndrome[3]), det);
+		lambda2 = gfDiv(gfMul(syndrome[1], syndrome[3]) ^ gfMul(syndrome[2], syndrome[2]), det);
+		len = 2;
+	} else {
+		lambda1 = gfDiv(syndrome[1], syndrome[0]);
+		lambda2 = 0;
+		len = 1;
+		if (gfMul(lambda1, syndrome[2]) != syndrome[3])
+			return 3;
+	}
+
+	if (!lambda1)
+		return 3;
+
+	// Error evaluator omega = S * lambda mod x^2 = S_0 + omega1 x
+	omega1 = syndrome[1] ^ gfMul(lambda1, syndrome[0]);
+
+	/*
+	 * Chien search over the 36 used positions (x = a^n for byte
+	 * 35 - n) and Forney's algorithm. Since lambda has degree <= 2, its
+	 * formal derivative is lambda1.
+	 */
+	x = xinv = 1;
+	for (n = 0; n < RS_BLOCK_LEN; n++, x = gfMulX(x), xinv = gfDivX(xinv)) {
+		i = RS_BLOCK_LEN - 1 - n;
+
+		if (gfMul(gfMul(lambda2, xinv) ^ lambda1, xinv) != 1)
+			continue;
+
+		value = gfMul(omega1, xinv) ^ syndrome[0];
+		*buffer_at(i) ^= gfMul(x, gfDiv(value, lambda1));
+		found++;
+	}
+
+	if (found != len)
+		return 3;
+	return found;
+}
+
+void FECModem::decode()
+{
+	uint8_t byte, errors;
+
+	if (dropping) {
+		this->Modem::buffer_clear();
+		return;
+	}
+
+	/*
+	 * Skip the calibration preamble (0x00 bytes, see
+	 * MessageSpecification.md). Bytes with a single bit set are
+	 * preamble bytes with a bit error, the first block always
+	 * starts with a START marker.
+	 */
+	while (preamble) {
+		if (!this->Modem::buffer_available())
+			return;
+		byte = *buffer_at(0);
+		if (byte & (byte - 1))
+			preamble = false;
+		else
+			this->Modem::buffer_get();
+	}
+
+	// A block cut short by the end of the transmission is dropped
+	if (this->Modem::buffer_available() < RS_BLOCK_LEN) {
+		if (transmissionEnded())
+			this->Modem::buffer_clear();
+		return;
+	}
+
+	errors = rsCorrect();
+#ifdef FEC_STATS
+	count_errors(errors);
+#endif
+
+	// Don't pass garbage on as pattern data, decode() drops the block
+	if (errors >= 3) {
+		resync = true;
+		dropping = true;
+		return;
+	}
+	pending = RS_DATA_LEN;
+}
+
+void FECModem::enable()
+{
+	this->Modem::enable();
+	pending = 0;
+	preamble = true;
+	resync = false;
+	dropping = false;
+}
+
+uint8_t FECModem::buffer_available()
+{
+	/*
+	 * Once all raw bytes of a transmission have been read and decoded,
+	 * the next raw byte starts a new preamble. Decoded bytes which were
+	 * not read yet still belong to the previous transmission.
+	 */
+	if (pending == 0) {
+		if (newTransmission()) {
+			preamble = true;
+			dropping = false;
+		}
+		decode();
+	}
+	return pending;
+}
+
+void FECModem::buffer_clear()
+{
+	pending = 0;
+	this->Modem::buffer_clear();
+}
+
+uint8_t FECModem::buffer_get()
+{
+	uint8_t byte;
+
+	if (buffer_available() == 0)
+		return 0;
+	byte = *buffer_at(RS_DATA_LEN - pending);
+	if (--pending == 0)
+		buffer_skip(RS_BLOCK_LEN);
+	return byte;
+}
+
+bool FECModem::resynchronized()
+{
+	if (resync) {
+		resync = false;
+		return true;
+	}
+	return false;
+}
+
+FECModem modem;
+
+#endif /* FEC_RS */
@@ -13,6 +13,7 @@
  */
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <stdlib.h>
 #include "modem.h"
 #include "fecmodem.h"
@@ -26,7 +27,7 @@ extern FECModem modem;
 
 bool Modem::newTransmission()
 {
-	if (new_transmission) {
+	if (new_transmission && (buffer_tail == buffer_start)) {
 		new_transmission = false;
 		return true;
 	}
@@ -37,34 +38,76 @@ bool Modem::newTransmission()
  * Returns number of available bytes in ringbuffer or 0 if empty
  */
 uint8_t Modem::buffer_available() {
+	if (new_transmission)
+		return buffer_start - buffer_tail;
 	return buffer_head - buffer_tail;
 }
 
-/*
- * Store 1 byte in ringbuffer
- */
-inline void Modem::buffer_put(const uint8_t c) {
-	if (buffer_available() != MODEM_BUFFER_SIZE) {
-		buffer[buffer_head++ % MODEM_BUFFER_SIZE] = c;
-	}
-}
-
 /*
  * Fetch 1 byte from ringbuffer
  */
 uint8_t Modem::buffer_get() {
 	uint8_t b = 0;
 	if (buffer_available() != 0) {
-		b = buffer[buffer_tail++ % MODEM_BUFFER_SIZE];
+		b = *buffer_slot(buffer_tail);
+		buffer_tail++;
 	}
 	return b;
 }
 
 
 void Modem::buffer_clear() {                 // needed that to avoid mess with framing bytes ....
-	buffer_head=buffer_tail=0;
+	uint8_t sreg = SREG;
+	cli();
+	buffer_tail = new_transmission ? buffer_start : buffer_head;
+	SREG = sreg;
 }
 
+#ifdef MODEM_BUFFER_EXPAND
+void Modem::buffer_expand(uint8_t *mem) {
+	uint8_t sreg, i;
+
+	if (buffer_ext)
+		return;
+
+	sreg = SREG;
+	cli();
+	// Move waiting bytes whose index now maps to mem
+	for (i = buffer_tail; i != buffer_head; i++)
+		if (i & MODEM_BUFFER_SIZE)
+			mem[i % MODEM_BUFFER_SIZE] = buffer[i % MODEM_BUFFER_SIZE];
+	buffer_ext = mem;
+	SREG = sreg;
+}
+
+void Modem::buffer_shrink() {
+	uint8_t sreg, i;
+
+	if (!buffer_ext)
+		return;
+
+	sreg = SREG;
+	cli();
+	if ((uint8_t)(buffer_head - buffer_tail) > MODEM_BUFFER_SIZE)
+		buffer_tail = buffer_head - MODEM_BUFFER_SIZE;
+	if (new_transmission && ((uint8_t)(buffer_start - buffer_tail) > MODEM_BUFFER_SIZE))
+		buffer_start = buffer_tail;
+	for (i = buffer_tail; i != buffer_head; i++)
+		if (i & MODEM_BUFFER_SIZE)
+			buffer[i % MODEM_BUFFER_SIZE] = buffer_ext[i % MODEM_BUFFER_SIZE];
+	buffer_ext = NULL;
+	SREG = sreg;
+}
+#else
+void Modem::buffer_expand(uint8_t *mem) {
+	buffer_ext = mem;
+}
+
+void Modem::buffer_shrink() {
+	buffer_ext = NULL;
+}
+#endif
+
 
 
 /*
@@ -76,22 +119,43 @@ void Modem::enable()  {
 	PORTA |= _BV(PA3);	
 	DDRC |= _BV(PC2);  // use E3 and E2 to indicate bit detection 
 
+#ifdef MODEM_COMPARATOR
+	/*
+	 * Analog comparator: bandgap reference (AIN+) vs. ADC6 / PA0 (AIN-,
+	 * through the ADC multiplexer, which requires the ADC to be off).
+	 * Its output triggers the Timer1 input capture.
+	 */
+	ADCSRA &= ~_BV(ADEN);
+	ADMUX = 6;
+	ADCSRB |= _BV(ACME);
+	ACSR = _BV(ACBG) | _BV(ACIC);
+#else
 	/* configure and enable ADC   */
 	ADCSRA = _BV(ADEN) + _BV(ADIE) + _BV(ADPS2) +  _BV(ADPS0) +_BV(ADATE) ; 
 	//  ADC prescaler 32 = 250KhZ - actually a bit overclocked ...
 	ADMUX = _BV(REFS0) + 6;  // chn6 = PA0 / ADC6
 	/*  start free running mode ** */
 	ADCSRA |= _BV(ADSC);	
+#endif
 
 #ifdef SPI_DBG
-	TIMSK0 &= ~_BV(TOIE0); // disable Led display! (use SPI for debugging output)
+	TIMSK0 &= ~(_BV(OCIE0A) | _BV(OCIE0B)); // disable Led display! (use SPI for debugging output)
 	PORTB=0; PORTD=255;
 	PORTA &= ~_BV(PA1);   // slave select enable
 	SPCR = (1<<SPE)|(1<<MSTR)|(1<<SPR0)|(1<<SPR1);
 #endif
 
+#ifdef MODEM_COMPARATOR
+	/* Timer1 at F_CPU / 8 = 1MHz, input capture with noise canceler */
+	TCCR1A = 0;
+	TCCR1B = _BV(ICNC1) | _BV(CS11);
+	TIFR1 = _BV(ICF1) | _BV(OCF1A);
+	// keep the display's animation clock (compare B)
+	TIMSK1 = (TIMSK1 & _BV(OCIE1B)) | _BV(ICIE1);
+#else
 	/* Timer: TCCR1: CS10 and CS11 bits: 8MHz clock with Prescaler 64 = 125kHz timer clock */
 	TCCR1B = _BV(CS11) | _BV(CS10);
+#endif
 	/* Modem pin as input */
 	MODEM_DDR &= ~_BV(MODEM_PIN);
 	/* Enable Pin Change Interrupts and PCINT for MODEM_PIN */
@@ -104,14 +168,20 @@ void Modem::disable()
 	PORTA &= ~_BV(PA3);
 	DDRA  &= ~_BV(PA3);
 
-	// disable ADC
 	DDRC &= ~ _BV(PC2);
+#ifdef MODEM_COMPARATOR
+	// disable input capture and analog comparator
+	TIMSK1 &= ~(_BV(ICIE1) | _BV(OCIE1A));
+	ACSR = _BV(ACD);
+#else
+	// disable ADC
 	ADCSRA &= ~ _BV(ADEN);
+#endif
 
 #ifdef SPI_DBG
 	PORTA |= _BV(PA1);  // slave select disable
 	SPCR=0;
-	TIMSK0 |= _BV(TOIE0); // enable Led display !
+	TIMSK0 |= _BV(OCIE0A); // enable Led display !
 #endif
 
 }
@@ -134,7 +204,7 @@ void Modem::receive() {
 	if (modem_pulselen > MODEM_SYNC_LEN) {
 		modem_bitlen = (modem_pulselen >> 2);
 		modem_bit = 0;
-		new_transmission = true;
+		buffer_mark();
 		return;
 	}
 
@@ -153,65 +223,336 @@ void Modem::receive() {
 #define FREQ_NONE 0
 #define FREQ_LOW 1
 #define FREQ_HIGH 2
-#define NUMBER_OF_SAMPLES 8
-#define ACTIVITY_THRESHOLD 150
-#define BITLEN_THRESHOLD 6
 
-void Modem::receiveADC() {
+/*
+ * Multiply by cos(45°) ~= 0.703 using shifts only (the ATtiny88 has no
+ * hardware multiplier).
+ */
+static inline int16_t mul_cos45(int16_t v)
+{
+	return (v >> 1) + (v >> 3) + (v >> 4) + (v >> 6);
+}
 
-	static uint8_t modem_bit = 0;
-	static uint8_t modem_byte = 0;
+/*
+ * Approximate sqrt(i^2 + q^2) with max(|i|, |q|) + min(|i|, |q|) / 2
+ * (error < 12%, good enough to compare two tones against each other)
+ */
+static inline uint16_t magnitude(int16_t i, int16_t q)
+{
+	uint16_t a = abs(i);
+	uint16_t b = abs(q);
+	return (a > b) ? a + (b >> 1) : b + (a >> 1);
+}
 
-	// some variables for sampling / frequency detection
-	uint16_t activity;
-	static uint8_t bitlength=0, cnt=0;
-	static uint16_t sampleValue=512, prevValue, accu;
-	static uint8_t actFrequency=FREQ_NONE, prevFrequency=FREQ_NONE;
-	
-	prevValue=sampleValue;
-	sampleValue=ADC;		
-	accu += (sampleValue>prevValue) ? sampleValue-prevValue : prevValue-sampleValue;
-	if (++cnt < NUMBER_OF_SAMPLES) return;   // accumulate NUMBER_OF_SAMPLES values
-
-	activity=accu; 
-	cnt=0; accu=0;
-
-	if (bitlength<100) bitlength++; 
-
-	if ((activity < ACTIVITY_THRESHOLD) && (bitlength > BITLEN_THRESHOLD<<2)) {    // no active sine wave detected
-		prevFrequency=FREQ_NONE;
-		modem_bit = 0;
-		modem_byte=0;
-		modem.buffer_clear();
-		PORTC &= ~ _BV(PC2);        // keep test signal low during idle phase
-		return;
-	} 
+#ifdef MODEM_PROFILES
+/*
+ * Per modulation profile: bits per symbol and up to three symbol length
+ * thresholds in steps (symbol i is at least thresholds[i - 1] steps long).
+ * See MODEM_PROFILE_*.
+ */
+static const uint8_t modemProfiles[MODEM_PROFILE_COUNT][4] PROGMEM = {
+	{1, MODEM_BITLEN_THRESHOLD, 0xff, 0xff},
+	{1, 5, 0xff, 0xff},
+	{2, 5, 8, 11},
+};
 
-	if (activity >= ACTIVITY_THRESHOLD) 
-		actFrequency=FREQ_HIGH;
-	else actFrequency=FREQ_LOW;
+/*
+ * Load the thresholds of profile, scaled by the calibrated symbol length
+ * (scale = sum of MODEM_CALIBRATION_SYMBOLS preamble symbols, nominally
+ * 16 * 4 = 64 steps)
+ */
+static void load_profile(uint8_t profile, uint8_t scale, uint8_t *thresholds)
+{
+	uint8_t i, threshold;
+
+	for (i = 0; i < 3; i++) {
+		threshold = pgm_read_byte(&modemProfiles[profile][i + 1]);
+		if (threshold != 0xff)
+			threshold = (threshold * scale + 32) >> 6;
+		thresholds[i] = threshold;
+	}
+}
+#endif
 
-	if (actFrequency != prevFrequency)  // bit change detected !
+/*
+ * Symbol decoder state, shared by both front ends
+ */
+static uint8_t modem_bit = 0;
+static uint8_t modem_byte = 0;
+
+// per-transmission calibration, see MODEM_CALIBRATION_SYMBOLS
+static uint8_t calibration = 0;
+static uint8_t calibration_sum;
+
+#ifdef MODEM_PROFILES
+static uint8_t thresholds[3] = {MODEM_BITLEN_THRESHOLD, 0xff, 0xff};
+
+// modulation profile, see MODEM_PROFILE_*
+static uint8_t symbol_bits = 1;
+static uint8_t rx_bytes = 0;
+#else
+static uint8_t threshold = MODEM_BITLEN_THRESHOLD;
+#endif
+
+void Modem::receiveEnd() {
+	modem_bit = 0;
+	modem_byte = 0;
+	buffer_mark();
+	PORTC &= ~ _BV(PC2);        // keep test signal low during idle phase
+
+	// forget the previous transmission's calibration and profile
+	calibration = 0;
+	calibration_sum = 0;
+#ifdef MODEM_PROFILES
+	load_profile(MODEM_PROFILE_STANDARD, 64, thresholds);
+	symbol_bits = 1;
+	rx_bytes = 0;
+#else
+	threshold = MODEM_BITLEN_THRESHOLD;
+#endif
+}
+
+bool Modem::receiveSymbol(uint8_t bitlength) {
+	bool calibrated = false;
+	uint8_t symbol;
+
+	if (calibration < MODEM_CALIBRATION_SYMBOLS) {
+		if (bitlength < MODEM_BITLEN_THRESHOLD) {
+			calibration_sum += bitlength;
+			if (++calibration == MODEM_CALIBRATION_SYMBOLS) {
+				/*
+				 * A long symbol is twice as long as a short one,
+				 * so the threshold is 1.5 times the average short
+				 * symbol length. Note that symbols of one tone tend
+				 * to be measured longer than those of the other one,
+				 * depending on their neighbours -- only the sum over
+				 * both tones is reliable.
+				 */
+#ifdef MODEM_PROFILES
+				load_profile(MODEM_PROFILE_STANDARD, calibration_sum, thresholds);
+#else
+				threshold = (MODEM_BITLEN_THRESHOLD * calibration_sum + 32) >> 6;
+#endif
+				calibrated = true;
+			}
+		} else {
+			// Not a preamble (e.g. old transmitter): keep the defaults
+			calibration = MODEM_CALIBRATION_SYMBOLS;
+			calibration_sum = 64;
+		}
+	}
+
+#ifdef MODEM_PROFILES
+	for (symbol = 0; (symbol < 3) && (bitlength >= thresholds[symbol]); symbol++)
+		;
+	if (symbol_bits == 2)
+		modem_byte = (modem_byte >> 2) | (symbol << 6);
+	else
+		modem_byte = (modem_byte >> 1) | (symbol << 7);
+	modem_bit += symbol_bits;
+#else
+	symbol = (bitlength >= threshold);
+	modem_byte = (modem_byte >> 1) | (symbol << 7);
+	modem_bit++;
+#endif
+	PORTC ^= _BV(PC2);   // show actual bit detection for debugging
+
+	// Check if we received complete byte and store it in ring buffer
+	if (!(modem_bit % 0x08))
 	{
-		if (prevFrequency!=FREQ_NONE) {   // skip first edge (no valid bitlength yet!)
-
-				modem_byte = (modem_byte >> 1) | (bitlength < BITLEN_THRESHOLD ? 0x00 : 0x80);
-				PORTC ^= _BV(PC2);   // show actual bit detection for debugging
-				
-				// Check if we received complete byte and store it in ring buffer
-				if (!(++modem_bit % 0x08)) 
-				{
-					buffer_put(modem_byte);
-					#ifdef SPI_DBG
-						SPDR = modem_byte;  // output detected byte to SPI for debugging
-					#endif
-				}
+#ifdef MODEM_PROFILES
+		if ((rx_bytes == MODEM_PREAMBLE_BYTES)
+				&& ((modem_byte & 0xf0) == MODEM_PROFILE_ANNOUNCE)
+				&& ((modem_byte & 0x0f) < MODEM_PROFILE_COUNT)) {
+			// Profile announcement, the next symbol uses the new profile
+			load_profile(modem_byte & 0x0f, calibration_sum, thresholds);
+			symbol_bits = pgm_read_byte(&modemProfiles[modem_byte & 0x0f][0]);
+		} else {
+			buffer_put(modem_byte);
 		}
-		prevFrequency=actFrequency;
-		bitlength=0;
+		if (rx_bytes <= MODEM_PREAMBLE_BYTES)
+			rx_bytes++;
+#else
+		buffer_put(modem_byte);
+#endif
+		#ifdef SPI_DBG
+			SPDR = modem_byte;  // output detected byte to SPI for debugging
+		#endif
 	}
+
+	return calibrated;
 }
 
+#ifdef MODEM_COMPARATOR
+
+/*
+ * Front end state: active is set between the first zero crossing of a
+ * transmission and the idle timeout (see receiveCaptureIdle)
+ */
+static bool capture_active = false;
+static uint8_t capture_frequency = FREQ_NONE;
+
+void Modem::receiveCapture() {
+	static uint16_t last_edge, change_edge, symbol_start;
+	static uint8_t nextFrequency = FREQ_NONE;
+	uint16_t edge = ICR1;
+	uint16_t halfperiod = edge - last_edge;
+	uint8_t actFrequency, bitlength;
+
+	// Capture the opposite edge next. Changing the edge may set ICF1.
+	TCCR1B ^= _BV(ICES1);
+	TIFR1 = _BV(ICF1);
+
+	if (!capture_active) {
+		// first zero crossing after a pause, arm the idle timeout
+		capture_active = true;
+		last_edge = edge;
+		OCR1A = edge + MODEM_CAPTURE_IDLE;
+		TIFR1 = _BV(OCF1A);
+		TIMSK1 |= _BV(OCIE1A);
+		return;
+	}
+
+	/*
+	 * Comparator chatter around a zero crossing. Keep measuring from the
+	 * last proper crossing.
+	 */
+	if (halfperiod < MODEM_CAPTURE_GLITCH)
+		return;
+
+	OCR1A = edge + MODEM_CAPTURE_IDLE;
+
+	actFrequency = (halfperiod < MODEM_CAPTURE_STEP * 3 / 4) ? FREQ_HIGH : FREQ_LOW;
+
+	/*
+	 * Like with the ADC front end, a tone change must be seen in two
+	 * consecutive half periods to count as a symbol edge. The symbol
+	 * edge is the start of the first of them.
+	 */
+	if (actFrequency == capture_frequency) {
+		nextFrequency = actFrequency;
+	} else if (actFrequency != nextFrequency) {
+		nextFrequency = actFrequency;
+		change_edge = last_edge;
+	} else {
+		if (capture_frequency != FREQ_NONE) {   // skip first edge (no valid bitlength yet!)
+			halfperiod = change_edge - symbol_start;
+			if (halfperiod < 100 * MODEM_CAPTURE_STEP)
+				bitlength = (halfperiod + MODEM_CAPTURE_STEP / 2) / MODEM_CAPTURE_STEP;
+			else
+				bitlength = 100;
+			receiveSymbol(bitlength);
+		}
+		capture_frequency = actFrequency;
+		symbol_start = change_edge;
+	}
+
+	last_edge = edge;
+}
+
+void Modem::receiveCaptureIdle() {
+	TIMSK1 &= ~_BV(OCIE1A);
+	capture_active = false;
+	if (capture_frequency != FREQ_NONE) {
+		capture_frequency = FREQ_NONE;
+		receiveEnd();
+	}
+}
+
+#else
+
+void Modem::receiveADC() {
+
+	// some variables for sampling / frequency detection
+	static uint16_t samples[MODEM_BLOCK_LEN];
+	static uint8_t bitlength = 0, cnt = 0;
+	static uint8_t prevFrequency = FREQ_NONE, nextFrequency = FREQ_NONE;
+	uint8_t actFrequency;
+	uint16_t mag_low, mag_high;
+
+	// per-transmission signal level, see MODEM_NOISE_FLOOR
+	static uint16_t noise_floor = MODEM_NOISE_FLOOR;
+	static uint16_t signal_level;
+
+	int16_t d04, d15, d26, d37;
+
+	samples[cnt++ % MODEM_BLOCK_LEN] = ADC;
+	if (cnt % MODEM_STEP_LEN) return;   // evaluate every MODEM_STEP_LEN samples
+
+	/*
+	 * Correlate the latest block with both tones (a single-bin DFT per
+	 * tone). MODEM_TONE_LOW has one period per block, so its reference
+	 * values are 0, ±cos(45°) and ±1. MODEM_TONE_HIGH has two periods, so
+	 * its references are 0 and ±1. The references are zero-mean, which
+	 * removes the ADC's DC offset for free. samples[] is a ring buffer,
+	 * so the oldest sample is at index 0 or 4 -- this only flips the
+	 * sign of the MODEM_TONE_LOW correlation and does not change the
+	 * magnitudes.
+	 */
+	d04 = samples[0] - samples[4];
+	d15 = samples[1] - samples[5];
+	d26 = samples[2] - samples[6];
+	d37 = samples[3] - samples[7];
+
+	mag_low = magnitude(d04 + mul_cos45(d15 - d37), d26 + mul_cos45(d15 + d37));
+	mag_high = magnitude((samples[0] + samples[4]) - (samples[2] + samples[6]),
+			(samples[1] + samples[5]) - (samples[3] + samples[7]));
+
+	if (bitlength < 100) bitlength++;
+
+	if ((mag_low < noise_floor) && (mag_high < noise_floor)) {
+		/*
+		 * No tone in this block. Short dropouts are bridged by simply
+		 * ignoring the block; only a longer pause ends the transmission.
+		 */
+		nextFrequency = prevFrequency;
+		if ((bitlength > MODEM_IDLE_STEPS) && (prevFrequency != FREQ_NONE)) {
+			prevFrequency = FREQ_NONE;
+			receiveEnd();
+			noise_floor = MODEM_NOISE_FLOOR;
+			signal_level = 0;
+		}
+		return;
+	}
+
+	if (mag_high > mag_low) {
+		actFrequency = FREQ_HIGH;
+	} else {
+		actFrequency = FREQ_LOW;
+		mag_high = mag_low;
+	}
+
+	// mag_high now holds the stronger tone's magnitude
+	if (calibration < MODEM_CALIBRATION_SYMBOLS) {
+		signal_level += ((int16_t)(mag_high - signal_level)) >> 3;
+	}
+
+	/*
+	 * A tone change must be seen in two consecutive steps to count as
+	 * a symbol edge. This filters out the mixed blocks at the start of a
+	 * transmission and single-step glitches. The edge itself happened one
+	 * step earlier, which is accounted for in bitlength.
+	 */
+	if (actFrequency == prevFrequency) {
+		nextFrequency = actFrequency;
+		return;
+	}
+	if (actFrequency != nextFrequency) {
+		nextFrequency = actFrequency;
+		return;
+	}
+
+	// bit change detected !
+	if (prevFrequency != FREQ_NONE) {   // skip first edge (no valid bitlength yet!)
+		if (receiveSymbol(bitlength) && ((signal_level >> 2) > MODEM_NOISE_FLOOR))
+			noise_floor = signal_level >> 2;
+	}
+	prevFrequency = actFrequency;
+	bitlength = 0;
+}
+
+#endif /* MODEM_COMPARATOR */
+
 
 /*
  * Pin Change Interrupt Vector. This is for wakeup.
@@ -219,9 +560,29 @@ void Modem::receiveADC() {
 ISR(PCINT3_vect) {
 }
 
+#ifdef MODEM_COMPARATOR
+
+/*
+ * Timer1 input capture: zero crossing of the modem signal
+ */
+ISR(TIMER1_CAPT_vect) {
+	modem.receiveCapture();
+}
+
+/*
+ * Timer1 compare match A: no zero crossing for MODEM_CAPTURE_IDLE ticks
+ */
+ISR(TIMER1_COMPA_vect) {
+	modem.receiveCaptureIdle();
+}
+
+#else
+
 /*
  * ADC Interrupt Vector.  This is used by te modem. 
  */
 ISR(ADC_vect) {
 	modem.receiveADC();
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
@@ -22,6 +22,115 @@
 #define MODEM_PIN		PA0
 #define MODEM_DDR		DDRA
 
+/*
+ * ADC sample rate: F_CPU / prescaler 32 / 13 ADC cycles per conversion,
+ * i.e. ~19.2kHz at 8MHz.
+ */
+#define MODEM_SAMPLE_RATE	(F_CPU / 32 / 13)
+
+/*
+ * Tone detector block length in samples. The two FSK tones are chosen so
+ * that they complete exactly one (MODEM_TONE_LOW) or two (MODEM_TONE_HIGH)
+ * periods per block, which makes them orthogonal over a single block and
+ * lets the correlator get by with additions and shifts. The detector slides
+ * over the samples and evaluates the latest block every MODEM_STEP_LEN
+ * samples (half a block), so symbol lengths are measured in half blocks.
+ */
+#define MODEM_BLOCK_LEN		8
+#define MODEM_STEP_LEN		4
+#define MODEM_TONE_LOW		(MODEM_SAMPLE_RATE / 8)
+#define MODEM_TONE_HIGH		(MODEM_SAMPLE_RATE / 4)
+
+/*
+ * Symbol lengths: Short symbol = 0 bit (2 blocks / 4 steps), long symbol
+ * = 1 bit (4 blocks / 8 steps). Consecutive symbols alternate between the
+ * two tones. A symbol shorter than MODEM_BITLEN_THRESHOLD steps is a 0 bit.
+ * This is only the default, see MODEM_CALIBRATION_SYMBOLS and
+ * MODEM_PROFILE_*.
+ */
+#define MODEM_BITLEN_THRESHOLD	6
+
+/*
+ * Modulation profiles (make PROFILES=1, MODEM_PROFILES, otherwise only
+ * MODEM_PROFILE_STANDARD is supported). The preamble is always sent with
+ * MODEM_PROFILE_STANDARD. A transmitter using a different profile sends
+ * MODEM_PROFILE_ANNOUNCE | profile as fourth byte (right after the
+ * preamble, still with MODEM_PROFILE_STANDARD) and switches to the new
+ * profile with the next symbol. The announcement is not stored in the
+ * receive buffer. Symbol lengths in steps:
+ *
+ * MODEM_PROFILE_STANDARD: 4, 8 (1 bit per symbol, ~800 bit/s)
+ * MODEM_PROFILE_FAST:     3, 6 (1 bit per symbol, ~1070 bit/s)
+ * MODEM_PROFILE_QUAD:     3, 6, 9, 12 (2 bits per symbol, ~1280 bit/s)
+ *
+ * Edge detection jitters by about one step depending on the tone and the
+ * phase of the edge, so symbol lengths are at least three steps apart and
+ * the shortest symbol is three steps long (the glitch filter needs two
+ * steps in which the detector block lies completely within the symbol).
+ */
+#define MODEM_PROFILE_STANDARD	0
+#define MODEM_PROFILE_FAST	1
+#define MODEM_PROFILE_QUAD	2
+#define MODEM_PROFILE_COUNT	3
+#define MODEM_PROFILE_ANNOUNCE	0x60
+
+/*
+ * Minimum tone magnitude (see Modem::receiveADC) to consider a block as
+ * part of a transmission. A sine with an amplitude of A ADC steps results
+ * in a magnitude of about 4 * A.
+ */
+#define MODEM_NOISE_FLOOR	32
+
+/*
+ * Each transmission starts with a preamble of short symbols (three 0x00
+ * bytes, which also form a valid Hamming 2416 triple). The first
+ * MODEM_CALIBRATION_SYMBOLS of them are used to measure the actual short
+ * symbol length and the signal level, from which the bit
+ * length thresholds and the noise floor for the rest of the transmission
+ * are derived.
+ */
+#define MODEM_CALIBRATION_SYMBOLS	16
+#define MODEM_PREAMBLE_BYTES	3
+
+/*
+ * Number of steps without any tone after which the transmission is
+ * considered to be over (~10ms).
+ */
+#define MODEM_IDLE_STEPS	48
+
+/*
+ * Analog comparator front end (make FRONTEND=comparator, MODEM_COMPARATOR),
+ * an alternative to the free-running ADC which does not cause any
+ * interrupts between transmissions. The comparator compares MODEM_PIN
+ * (ADC6, through the ADC multiplexer) against the internal bandgap
+ * reference and triggers the Timer1 input capture on every zero crossing.
+ * Timer1 runs at F_CPU / 8, so a detector step (MODEM_STEP_LEN ADC samples)
+ * is MODEM_CAPTURE_STEP ticks long, a half period of MODEM_TONE_HIGH half a
+ * step and one of MODEM_TONE_LOW a whole step. Symbol lengths are converted
+ * to steps and decoded like with the ADC. Half periods shorter than
+ * MODEM_CAPTURE_GLITCH ticks are comparator chatter and ignored, after
+ * MODEM_CAPTURE_IDLE ticks without a zero crossing the transmission is over.
+ *
+ * The comparator has neither a noise floor nor automatic level adjustment:
+ * the signal must swing across the bandgap voltage (~1.1V), so the input
+ * bias has to be close to it. The stock board biases the input to about
+ * half the supply voltage, so this requires a different bias divider (see
+ * README.md).
+ */
+#define MODEM_CAPTURE_STEP	(MODEM_STEP_LEN * 32 * 13 / 8)
+#define MODEM_CAPTURE_GLITCH	(MODEM_CAPTURE_STEP / 4)
+#define MODEM_CAPTURE_IDLE	(MODEM_IDLE_STEPS * MODEM_CAPTURE_STEP)
+
+/*
+ * Timer1 clock as configured by Modem::enable(). The timer is never
+ * cleared, so Display uses its compare unit B as animation clock.
+ */
+#ifdef MODEM_COMPARATOR
+#define MODEM_TIMER1_HZ		(F_CPU / 8)
+#else
+#define MODEM_TIMER1_HZ		(F_CPU / 64)
+#endif
+
 /**
  * Receive-only modem. Sets up a pin change interrupt on the modem pin
  * and receives bytes using a simple protocol. Does not detect or correct
@@ -29,28 +138,159 @@
  */
 class Modem {
 	private:
-		uint8_t buffer_head;
-		uint8_t buffer_tail;
+		/*
+		 * The receive buffer is a single-producer single-consumer queue:
+		 * the receive interrupt (receiveADC() or receiveCapture()) only
+		 * writes buffer_head, buffer_start and new_transmission, the
+		 * main loop only writes buffer_tail. Both indexes are free-running, index i is stored
+		 * in buffer[i % MODEM_BUFFER_SIZE], or -- with
+		 * MODEM_BUFFER_EXPAND, while additional memory is lent to the
+		 * modem with buffer_expand() and bit 6 of i is set -- in
+		 * buffer_ext[i % MODEM_BUFFER_SIZE].
+		 */
+		volatile uint8_t buffer_head;
+		volatile uint8_t buffer_tail;
 		uint8_t buffer[MODEM_BUFFER_SIZE];
-		bool new_transmission;
-		void buffer_put(const uint8_t c);
+		uint8_t * volatile buffer_ext;
+
+		/**
+		 * buffer_head at the end of the previous transmission. Bytes
+		 * before it belong to the previous transmission, see
+		 * newTransmission().
+		 */
+		volatile uint8_t buffer_start;
+		volatile bool new_transmission;
+
+		/**
+		 * Number of bytes dropped because the buffer was full
+		 * (saturates at 255)
+		 */
+		volatile uint8_t buffer_overflows;
+
+		inline uint8_t *buffer_slot(uint8_t i) {
+#ifdef MODEM_BUFFER_EXPAND
+			if (buffer_ext && (i & MODEM_BUFFER_SIZE))
+				return buffer_ext + (i % MODEM_BUFFER_SIZE);
+#endif
+			return buffer + (i % MODEM_BUFFER_SIZE);
+		};
+
+		/**
+		 * Marks the current buffer_head as start of a new transmission.
+		 * Interrupt context only.
+		 */
+		inline void buffer_mark(void) {
+			buffer_start = buffer_head;
+			new_transmission = true;
+		};
+	protected:
+		/**
+		 * Stores a received byte in the receive buffer or counts an
+		 * overflow if it is full. Interrupt context only (protected so
+		 * that host test benches in utilities/host can inject raw bytes).
+		 */
+		inline void buffer_put(const uint8_t c) {
+			uint8_t head = buffer_head;
+#ifdef MODEM_BUFFER_EXPAND
+			if ((uint8_t)(head - buffer_tail) == (buffer_ext ? 2 : 1) * MODEM_BUFFER_SIZE) {
+#else
+			if ((uint8_t)(head - buffer_tail) == MODEM_BUFFER_SIZE) {
+#endif
+				if (buffer_overflows != 0xff)
+					buffer_overflows++;
+				return;
+			}
+			*buffer_slot(head) = c;
+			buffer_head = head + 1;
+		};
+
+		/**
+		 * Unprocessed byte offset bytes after the next one returned by
+		 * buffer_get(). offset must be less than buffer_available().
+		 * Lets derived classes decode (and correct) a block of bytes in
+		 * place before consuming it with buffer_skip().
+		 */
+		inline uint8_t *buffer_at(uint8_t offset) {
+			return buffer_slot(buffer_tail + offset);
+		};
+
+		/**
+		 * Consumes count unprocessed bytes, see buffer_at()
+		 */
+		inline void buffer_skip(uint8_t count) { buffer_tail += count; };
+
+		/**
+		 * True if the current transmission has ended, so that
+		 * buffer_available() does not grow until all of its bytes have
+		 * been read (see newTransmission())
+		 */
+		inline bool transmissionEnded(void) { return new_transmission; };
+
+		/**
+		 * Decodes a symbol of bitlength detector steps (see
+		 * MODEM_STEP_LEN) and stores complete bytes in the buffer.
+		 * Shared by both front ends.
+		 * @return true if this symbol completed the calibration
+		 */
+		bool receiveSymbol(uint8_t bitlength);
+
+		/**
+		 * Ends the current transmission: marks the buffer (see
+		 * newTransmission()) and resets calibration and profile.
+		 */
+		void receiveEnd(void);
 	public:
-		Modem() {new_transmission = false;};
+		Modem() {buffer_head = buffer_tail = buffer_start = 0; buffer_ext = NULL; buffer_overflows = 0; new_transmission = false;};
 
 		/**
 		 * Checks if a new transmission was started since the last call
 		 * to this function. Returns true if that is the case and false
-		 * otherwise.
+		 * otherwise. With receiveADC(), this happens once all bytes of
+		 * the previous transmission have been read from the buffer, so
+		 * the next byte is the first byte of a new transmission.
 		 * @return true if a new transmission was started
 		 */
 		bool newTransmission();
 
 		/**
 		 * Checks if there are unprocessed bytes in the modem receive buffer.
+		 * While a new transmission is pending (see newTransmission()),
+		 * only the bytes of the previous transmission are counted.
 		 * @return number of unprocessed bytes
 		 */
 		uint8_t buffer_available(void);
 
+		/**
+		 * Number of received bytes which were dropped because the buffer
+		 * was full (saturates at 255).
+		 */
+		uint8_t buffer_overflow_count(void) { return buffer_overflows; };
+
+		/**
+		 * Lend MODEM_BUFFER_SIZE bytes of memory to the receive buffer,
+		 * doubling its capacity, e.g. while an EEPROM write blocks the
+		 * main loop. mem must not be used otherwise until
+		 * buffer_shrink() is called. Does nothing if the buffer is
+		 * already expanded. Without MODEM_BUFFER_EXPAND (make
+		 * BUFFER_EXPAND=1), mem is not used and the capacity stays at
+		 * MODEM_BUFFER_SIZE, but buffer_expanded() still reports it.
+		 *
+		 * @param mem MODEM_BUFFER_SIZE bytes of memory
+		 */
+		void buffer_expand(uint8_t *mem);
+
+		/**
+		 * Return the memory lent by buffer_expand(). If more than
+		 * MODEM_BUFFER_SIZE bytes are waiting in the buffer, the oldest
+		 * ones are discarded.
+		 */
+		void buffer_shrink(void);
+
+		/**
+		 * Checks whether buffer_expand() memory is in use.
+		 */
+		bool buffer_expanded(void) { return buffer_ext != NULL; };
+
 		/**
 		 * Get next byte from modem receive buffer.
 		 * @return next unprocessed byte (0 if the buffer is empty)
@@ -77,9 +317,44 @@ class Modem {
 		 * Do not call this function yourself.
 		 */
 		void receive(void);
-		
-		void receiveADC(void);   // added for signal decoding via ADC
-		void buffer_clear(void);  // clear the receive buffer
+
+#ifdef MODEM_COMPARATOR
+		/**
+		 * Called by the Timer1 input capture interrupt service routine
+		 * for every zero crossing. Decodes bits from the length of
+		 * the tone symbols (measured in half periods) and stores
+		 * complete bytes in the buffer.
+		 *
+		 * Do not call this function yourself.
+		 */
+		void receiveCapture(void);
+
+		/**
+		 * Called by the Timer1 compare match A interrupt service
+		 * routine MODEM_CAPTURE_IDLE ticks after the last zero crossing.
+		 * Ends the transmission.
+		 *
+		 * Do not call this function yourself.
+		 */
+		void receiveCaptureIdle(void);
+#else
+		/**
+		 * Called by the ADC interrupt service routine for every sample.
+		 * Collects MODEM_BLOCK_LEN samples, correlates them with the two
+		 * FSK tones and decodes bits from the length of the resulting
+		 * tone symbols. Complete bytes are stored in the buffer.
+		 *
+		 * Do not call this function yourself.
+		 */
+		void receiveADC(void);
+#endif
+
+		/**
+		 * Discard all unprocessed bytes in the receive buffer. If a new
+		 * transmission is pending, only the bytes of the previous one are
+		 * discarded.
+		 */
+		void buffer_clear(void);
 };
 
 #endif /* MODEM_H_ */
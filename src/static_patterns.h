@@ -98,4 +98,20 @@ const uint8_t PROGMEM timeoutPattern[] = {
 };
 #endif
 
+#ifdef LANG_DE
+const uint8_t PROGMEM corruptPattern[] = {
+	0x10, 0x11,
+	0xe0, 0x00,
+	' ',   2, ' ', 'S', 'p', 'e', 'i', 'c', 'h', 'e', 'r', 'f', 'e', 'h',
+	'l', 'e', 'r'
+};
+#else
+const uint8_t PROGMEM corruptPattern[] = {
+	0x10, 0x10,
+	0xe0, 0x00,
+	' ',   2, ' ', 'S', 't', 'o', 'r', 'a', 'g', 'e', ' ', 'e', 'r', 'r',
+	'o', 'r'
+};
+#endif
+
 #endif /* STATIC_PATTERNS_H_ */
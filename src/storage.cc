@@ -8,29 +8,73 @@
  *
  */
 
-#include <util/delay.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <stdlib.h>
+#include <string.h>
+#include <util/crc16.h>
+#include <util/delay.h>
 
 #include "storage.h"
+#include "modem.h"
 
 Storage storage;
 
 /*
  * EEPROM data structure ("file system"):
  *
- * Organized as 32B-pages, all animations/texts are page-aligned.  Byte 0 ..
- * 255 : storage metadata. Byte 0 contains the number of animations, byte 1 the
- * page offset of the first animation, byte 2 of the second, and so on.
+ * Organized as 32B-pages, all animations/texts are page-aligned. There are
+ * two layout versions, byte 255 tells them apart (0xff: version 1, 0x03:
+ * version 3). Storage::enable() detects the layout of the EEPROM, new
+ * transmissions and carousel images (see MessageSpecification.md) are
+ * written in version 3. Without STORAGE_LOG, new transmissions are written in
+ * version 1 and version 3 is not read. Version 2 (0x02, 16 bit page offsets
+ * in bytes 257 .. 510) is superseded by version 3 and no longer read.
+ *
+ * Version 1 (up to 8 KiB):
+ * Byte 0 .. 255 : storage metadata. Byte 0 contains the number of
+ * animations, byte 1 the page offset of the first animation, byte 2 of the
+ * second, and so on.
  * Byte 256+: texts/animations without additional storage metadata, aligned
  * to 32B. So, a maximum of 256-(256/32) = 248 texts/animations can be stored,
  * and a maximum of 255 * 32 = 8160 Bytes (almost 8 kB / 64 kbit) can be
- * addressed.  To support larger EEPROMS, change the metadate area to Byte 2 ..
- * 511 and use 16bit page pointers.
+ * addressed.
+ *
+ * Version 3 (log-structured, up to 64 KiB):
+ * Byte 0 .. 511 and 512 .. 1023 : two directory slots (A and B). Relative to
+ * the start of a slot, byte 0 contains the number of animations, bytes
+ * 4 .. 251 and 256 .. 503 the directory entries, byte 254 the generation
+ * (increased by one for each transmission), byte 255 the layout version,
+ * bytes 506 .. 507 the log head (the data page after the most recently
+ * written pattern) and bytes 510 .. 511 a CRC16 (avr-libc _crc16_update,
+ * initial value 0xffff) over the directory entries, the log head, the
+ * number of animations and the generation. A directory entry consists of
+ * the page offset and a CRC16 over the header and data of its pattern
+ * (16 bit little endian each). Entries are 4-byte aligned, so each one is
+ * written at once.
+ * Byte 1024+: texts/animations, aligned to 32B. Up to 124 texts/animations
+ * and (65536 - 1024) / 32 = 2016 pages can be addressed.
+ *
+ * The valid slot with the newer generation holds the stored patterns. A new
+ * transmission writes its patterns at the log head, wrapping around at the
+ * end of the data area (a single pattern never wraps), and its directory to
+ * the other slot. Each directory entry is written after the last page of
+ * its pattern, and the number of animations, generation, log head and CRC
+ * are written last (Storage::sync()). So an interrupted transmission leaves
+ * the previous patterns intact unless it needed their pages. Byte 255 of
+ * slot A always contains 0x03, so version 3 can be told apart from the
+ * others.
+ *
+ * A transmission may also edit the stored patterns (Storage::edit()). Its
+ * directory then starts as a copy of the stored one, and new or replacing
+ * patterns only use the pages between the log head and the oldest page
+ * still in use (the log tail, found by Storage::mount()). Pages of replaced
+ * or removed patterns are reused once the tail moves past them.
  *
  * The text/animation size is not limited by this approach.
  *
- * Example:
+ * Example (version 1):
  * Byte     0 = 3 -> we've got a total of three animations
  * Byte     1 = 0 -> first text/animation starts at byte 256 + 32*0 = 256
  * Byte     2 = 4 -> second starts at byte 256 + 32*4 = 384
@@ -45,210 +89,605 @@ Storage storage;
  *            .
  *            .
  *            .
+ *
+ * Example (version 3, second transmission):
+ * Byte     0 = 2 -> slot A: two animations from the first transmission
+ * Byte   254 = 1 -> generation 1
+ * Byte   255 = 3 -> layout version 3
+ * Byte   512 = 1 -> slot B: one animation from the second transmission
+ * Byte   516 = 6 -> starts at byte 1024 + 32*6 = 1216, after the first two
+ * Byte   517 = 0 -> (upper byte)
+ * Byte   518 = (CRC16 of the animation, lower byte)
+ * Byte   766 = 2 -> generation 2, newer than slot A
+ * Byte  1018 = 8 -> log head: the next transmission starts at page 8
  */
 
+/*
+ * Sets the I2C clock frequency.
+ * freq = F_CPU / (16 + (2 * TWBR * TWPS) )
+ * let TWPS = "00" = 1
+ * -> TWBR = (F_CPU / freq) - 16 / 2
+ */
+#define I2C_TWBR(freq) (((F_CPU / (freq)) - 16) / 2)
+
 void Storage::enable()
 {
+#ifdef I2C_FAST_MODE
+	uint8_t ref[8], buf[8];
+#endif
+
+	TWSR = 0; // the lower two bits control TWPS
+	TWBR = I2C_TWBR(I2C_STANDARD_HZ);
+
+#ifdef I2C_FAST_MODE
 	/*
-	 * Set I2C clock frequency to 100kHz.
-	 * freq = F_CPU / (16 + (2 * TWBR * TWPS) )
-	 * let TWPS = "00" = 1
-	 * -> TWBR = (F_CPU / 100000) - 16 / 2
+	 * Probe fast mode: the first directory bytes must read the same at
+	 * 400kHz as at 100kHz. Weak pull-ups or a long bus show up as
+	 * NACKs or flipped bits, in that case we stay at 100kHz.
 	 */
-	TWSR = 0; // the lower two bits control TWPS
-	TWBR = ((F_CPU / 100000UL) - 16) / 2;
+	if (i2c_read(0, 0, sizeof(ref), ref) == I2C_OK) {
+		TWBR = I2C_TWBR(I2C_FAST_HZ);
+		if ((i2c_read(0, 0, sizeof(buf), buf) != I2C_OK)
+				|| memcmp(ref, buf, sizeof(buf)))
+			TWBR = I2C_TWBR(I2C_STANDARD_HZ);
+	}
+#endif
 
 	i2c_read(0, 0, 1, &num_anims);
+	i2c_read(0, 255, 1, &layout);
+
+	if (layout == STORAGE_LAYOUT_V3) {
+#ifdef STORAGE_LOG
+		mount();
+#else
+		// the next transmission replaces them, see wipe()
+		num_anims = 0xff;
+#endif
+	} else if (layout != STORAGE_LAYOUT_V1) {
+		// Unknown layout (e.g. from a newer firmware) -> no usable data
+		num_anims = 0xff;
+	}
 }
 
+uint16_t Storage::busClock()
+{
+	return F_CPU / (16 + 2 * TWBR) / 1000;
+}
 
 /*
- * Send an I2C (re)start condition and the EEPROM address in read mode. Returns
- * after it has been transmitted successfully.
+ * Number of pages used by a pattern, according to its header (see
+ * MessageSpecification.md)
  */
-uint8_t Storage::i2c_start_read()
+static uint8_t patternPages(uint8_t *header)
 {
-	TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN);
-	while (!(TWCR & _BV(TWINT)));
-	if (!(TWSR & 0x18)) // 0x08 == START ok, 0x10 == RESTART ok
-		return I2C_START_ERR;
-
-	// Note: The R byte ("... | 1") causes the TWI module to switch to
-	// Master Receive mode
-	TWDR = (I2C_EEPROM_ADDR << 1) | 1;
-	TWCR = _BV(TWINT) | _BV(TWEN);
-	while (!(TWCR & _BV(TWINT)));
-	if (TWSR != 0x40) // 0x40 == SLA+R transmitted, ACK receveid
-		return I2C_ADDR_ERR;
-
-	return I2C_OK;
+	return (((header[0] & 0x0f) << 8) + header[1] + 4 + 31) / 32;
 }
 
+#ifdef STORAGE_LOG
 /*
- * Send an I2C (re)start condition and the EEPROM address in write mode.
- * Returns after it has been transmitted successfully.
+ * Offset of directory entry idx inside a layout version 3 slot
  */
-uint8_t Storage::i2c_start_write()
+static uint16_t entryOffset(uint8_t idx)
 {
-	TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN);
-	while (!(TWCR & _BV(TWINT)));
-	if (!(TWSR & 0x18)) // 0x08 == START ok, 0x10 == RESTART ok
-		return I2C_START_ERR;
+	return 4 + (idx * 4) + ((idx >= 62) ? 4 : 0);
+}
 
-	TWDR = (I2C_EEPROM_ADDR << 1) | 0;
-	TWCR = _BV(TWINT) | _BV(TWEN);
-	while (!(TWCR & _BV(TWINT)));
-	if (TWSR != 0x18) // 0x18 == SLA+W transmitted, ACK received
-		return I2C_ADDR_ERR;
+uint16_t Storage::scanSlot(uint8_t slot, uint8_t count, uint16_t head, uint16_t *tail)
+{
+	uint8_t buf[16];
+	uint8_t i, j, len;
+	uint16_t crc = 0xffff, addr, page, dist, min_dist = 0xffff;
 
-	return I2C_OK;
+	*tail = head;
+
+	// four entries at a time, not crossing the version byte
+	for (i = 0; i < count; i += len) {
+		len = (count - i < 4) ? count - i : 4;
+		if ((i < 62) && (i + len > 62))
+			len = 62 - i;
+		addr = (slot * 512) + entryOffset(i);
+		i2c_read(addr >> 8, addr & 0xff, len * 4, buf);
+		for (j = 0; j < len * 4; j += 4) {
+			crc = _crc16_update(crc, buf[j]);
+			crc = _crc16_update(crc, buf[j + 1]);
+			crc = _crc16_update(crc, buf[j + 2]);
+			crc = _crc16_update(crc, buf[j + 3]);
+
+			// the pattern written first after the head is the oldest one
+			page = buf[j] | (buf[j + 1] << 8);
+			dist = (page >= head) ? page - head : page + STORAGE_V3_PAGES - head;
+			if (dist < min_dist) {
+				min_dist = dist;
+				*tail = page;
+			}
+		}
+	}
+	crc = _crc16_update(crc, head & 0xff);
+	crc = _crc16_update(crc, head >> 8);
+	return crc;
 }
 
-/*
- * Send an I2C stop condition.
- */
-void Storage::i2c_stop()
+bool Storage::checkSlot(uint8_t slot, uint8_t *count, uint8_t *generation, uint16_t *log)
 {
-	TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+	uint8_t meta[6];
+	uint16_t crc;
+
+	i2c_read(slot * 2, 0, 1, count);
+	i2c_read(slot * 2, 254, 2, meta);
+	*generation = meta[0];
+
+	if ((meta[1] != STORAGE_LAYOUT_V3) || (*count > STORAGE_V3_ANIMS))
+		return false;
+
+	// log head (bytes 506 .. 507) and CRC (bytes 510 .. 511)
+	i2c_read(slot * 2 + 1, 250, 6, meta);
+	log[1] = meta[0] | (meta[1] << 8);
+	if (log[1] >= STORAGE_V3_PAGES)
+		return false;
+
+	crc = scanSlot(slot, *count, log[1], &log[0]);
+	crc = _crc16_update(crc, *count);
+	crc = _crc16_update(crc, *generation);
+
+	return (meta[4] == (crc & 0xff)) && (meta[5] == (crc >> 8));
 }
 
-/*
- * Sends len bytes to the EEPROM. Note that this method does NOT
- * send I2C start or stop conditions.
- */
-uint8_t Storage::i2c_send(uint8_t len, uint8_t *data)
+void Storage::mount()
 {
-	uint8_t pos = 0;
+	uint8_t count, generation;
+	uint16_t log[2];
+	bool found = false;
 
-	for (pos = 0; pos < len; pos++) {
-		TWDR = data[pos];
-		TWCR = _BV(TWINT) | _BV(TWEN);
-		while (!(TWCR & _BV(TWINT)));
-		if (TWSR != 0x28) // 0x28 == byte transmitted, ACK received
-			return pos;
+	for (uint8_t slot = 0; slot < 2; slot++) {
+		// generations wrap around, the newer one is at most 127 ahead
+		if (checkSlot(slot, &count, &generation, log)
+				&& (!found || (int8_t)(generation - log_generation) > 0)) {
+			found = true;
+			log_slot = slot;
+			log_generation = generation;
+			log_start = log[0];
+			log_end = log[1];
+			num_anims = count;
+		}
 	}
 
-	return pos;
+	if (!found)
+		num_anims = 0xff;
+
+	verifyReset();
 }
 
+bool Storage::inLog(uint16_t page)
+{
+	if (log_start < log_end)
+		return (page >= log_start) && (page < log_end);
+	// wrapped around (or occupying the whole data area)
+	return (page >= log_start) || (page < log_end);
+}
+#endif /* STORAGE_LOG */
+
+
 /*
- * Receives len bytes from the EEPROM into data. Note that this method does
- * NOT send I2C start or stop conditions.
+ * Interrupt-driven TWI engine. Each transfer is a complete EEPROM
+ * transaction: start, SLA+W, two address bytes and either the data bytes
+ * (write) or a repeated start, SLA+R and the data bytes (read), then stop.
+ * A read which continues where the previous one ended (e.g. the chunks of
+ * a running pattern) uses the EEPROM's address pointer instead: start,
+ * SLA+R, data bytes, stop.
+ * TWINT is cleared by writing a one to it, which starts the next bus
+ * operation.
  */
-uint8_t Storage::i2c_receive(uint8_t len, uint8_t *data)
+
+#define TWCR_NEXT (_BV(TWINT) | _BV(TWEN) | _BV(TWIE))
+
+void Storage::i2c_start(bool stop)
 {
-	uint8_t pos = 0;
+	I2CRequest *req = i2c_queue[i2c_queue_tail % I2C_QUEUE_LEN];
 
-	for (pos = 0; pos < len; pos++) {
-		if (pos == len-1) {
-			// Don't ACK the last byte
-			TWCR = _BV(TWINT) | _BV(TWEN);
-		} else {
-			// Automatically send ACK
-			TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWEA);
-		}
-		while (!(TWCR & _BV(TWINT)));
-		data[pos] = TWDR;
-		/*
-		 * No error handling here -- We send the acks, the EEPROM only
-		 * supplies raw data, so there's no way of knowing whether it's still
-		 * talking to us or we're just reading garbage.
-		 */
+	if (req->read && i2c_addr_valid
+			&& (i2c_addr == (uint16_t)((req->addrhi << 8) | req->addrlo)))
+		i2c_pos = 2;
+	else
+		i2c_pos = 0;
+	if (stop)
+		TWCR = TWCR_NEXT | _BV(TWSTO) | _BV(TWSTA);
+	else
+		TWCR = TWCR_NEXT | _BV(TWSTA);
+}
+
+void Storage::i2c_finish(uint8_t status)
+{
+	I2CRequest *req = i2c_queue[i2c_queue_tail % I2C_QUEUE_LEN];
+
+	// reads wrap around at the end of the memory, writes within the page
+	if (req->read && (status == I2C_OK)) {
+		i2c_addr = (((req->addrhi << 8) | req->addrlo) + req->len) % STORAGE_SIZE;
+		i2c_addr_valid = true;
+	} else {
+		i2c_addr_valid = false;
 	}
 
-	return pos;
+	req->status = status;
+	i2c_queue_tail++;
+
+	if (i2c_queue_head != i2c_queue_tail) {
+		i2c_tries = 0;
+		i2c_start(true);
+	} else {
+		TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+	}
 }
 
-/*
- * Writes len bytes of data into the EEPROM, starting at byte number pos.
- * Does not check for page boundaries.
- * Includes a complete I2C transaction.
- */
-uint8_t Storage::i2c_write(uint8_t addrhi, uint8_t addrlo, uint8_t len, uint8_t *data)
+void Storage::i2c_interrupt()
 {
-	uint8_t addr_buf[2];
-	uint8_t num_tries;
+	I2CRequest *req = i2c_queue[i2c_queue_tail % I2C_QUEUE_LEN];
 
-	addr_buf[0] = addrhi;
-	addr_buf[1] = addrlo;
+	switch (TWSR & 0xf8) {
+		case 0x08: // START transmitted
+		case 0x10: // repeated START transmitted
+			// address bytes not sent yet -> write mode
+			TWDR = (I2C_EEPROM_ADDR << 1) | (i2c_pos < 2 ? 0 : 1);
+			TWCR = TWCR_NEXT;
+			return;
+		case 0x18: // SLA+W transmitted, ACK received
+		case 0x28: // data byte transmitted, ACK received
+			if (i2c_pos == 0) {
+				TWDR = req->addrhi;
+			} else if (i2c_pos == 1) {
+				TWDR = req->addrlo;
+			} else if (req->read) {
+				// address set, switch to master receive mode
+				TWCR = TWCR_NEXT | _BV(TWSTA);
+				return;
+			} else if (i2c_pos - 2 < req->len) {
+				TWDR = req->data[i2c_pos - 2];
+			} else {
+				i2c_finish(I2C_OK);
+				return;
+			}
+			i2c_pos++;
+			TWCR = TWCR_NEXT;
+			return;
+		case 0x50: // data byte received, ACK returned
+			req->data[i2c_pos++ - 2] = TWDR;
+			// fall through
+		case 0x40: // SLA+R transmitted, ACK received
+			// don't ACK the last byte
+			if (i2c_pos - 2 < req->len - 1)
+				TWCR = TWCR_NEXT | _BV(TWEA);
+			else
+				TWCR = TWCR_NEXT;
+			return;
+		case 0x58: // data byte received, NACK returned
+			req->data[i2c_pos - 2] = TWDR;
+			i2c_finish(I2C_OK);
+			return;
+	}
 
 	/*
-	 * The EEPROM might be busy processing a write command, which can
-	 * take up to 10ms. Wait up to 16ms to respond before giving up.
-	 * All other error conditions (even though they should never happen[tm])
-	 * are handled the same way.
+	 * Address or data NACK (most likely the EEPROM is busy writing),
+	 * arbitration lost, bus error: release the bus and retry from the
+	 * start later (see poll()). Retrying right away would keep the CPU
+	 * busy with TWI interrupts for the whole write cycle.
 	 */
-	for (num_tries = 0; num_tries < 32; num_tries++) {
-		if (num_tries > 0)
-			_delay_us(500);
+	i2c_addr_valid = false;
+	if (++i2c_tries < I2C_MAX_TRIES) {
+		TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWSTO);
+		i2c_retry_time = TCNT1;
+		i2c_retry = true;
+	} else {
+		i2c_finish(I2C_ERR);
+	}
+}
 
-		if (i2c_start_write() != I2C_OK)
-			continue; // EEPROM is busy writing
+void Storage::poll()
+{
+	uint8_t sreg = SREG;
 
-		if (i2c_send(2, addr_buf) != 2)
-			continue; // should not happen
+	// TCNT1 is a 16 bit register, don't let an ISR use TEMP meanwhile
+	cli();
+	if (i2c_retry && ((uint16_t)(TCNT1 - i2c_retry_time)
+			>= MODEM_TIMER1_HZ / (1000000UL / I2C_RETRY_US))) {
+		i2c_retry = false;
+		i2c_start(false);
+	}
+	SREG = sreg;
+}
 
-		if (i2c_send(len, data) != len)
-			continue; // should not happen
+void Storage::i2c_submit(I2CRequest *req)
+{
+	uint8_t sreg;
 
-		i2c_stop();
-		return I2C_OK;
+	req->status = I2C_PENDING;
+
+	// wait for a free queue slot
+	while ((uint8_t)(i2c_queue_head - i2c_queue_tail) == I2C_QUEUE_LEN)
+		i2c_wait(i2c_queue[i2c_queue_tail % I2C_QUEUE_LEN]);
+
+	sreg = SREG;
+	cli();
+	i2c_queue[i2c_queue_head % I2C_QUEUE_LEN] = req;
+	if (i2c_queue_head++ == i2c_queue_tail) {
+		i2c_tries = 0;
+		i2c_start(false);
 	}
+	SREG = sreg;
+}
 
-	i2c_stop();
-	return I2C_ERR;
+void Storage::i2c_wait(I2CRequest *req)
+{
+	while (req->status == I2C_PENDING) {
+		if (i2c_retry) {
+			/*
+			 * The EEPROM is busy and no interrupt of ours is going
+			 * to wake us up (the display and modem may be off, too)
+			 */
+			_delay_us(I2C_RETRY_US);
+			i2c_retry = false;
+			i2c_start(false);
+		} else if (SREG & _BV(SREG_I)) {
+			/*
+			 * Sleep until the next interrupt. The instruction after
+			 * sei() is always executed before any pending interrupt,
+			 * so the TWI interrupt cannot slip in between the check
+			 * and the sleep.
+			 */
+			cli();
+			if (req->status == I2C_PENDING) {
+				SMCR = _BV(SE);
+				sei();
+				sleep_cpu();
+			}
+			sei();
+		} else if (TWCR & _BV(TWINT)) {
+			// Interrupts are disabled (e.g. during initialization)
+			i2c_interrupt();
+		}
+	}
 }
 
 /*
  * Reads len bytes of data from the EEPROM, starting at byte number pos.
  * Does not check for page boundaries.
- * Includes a complete I2C transaction.
+ * Thin synchronous wrapper around the TWI engine.
  */
 uint8_t Storage::i2c_read(uint8_t addrhi, uint8_t addrlo, uint8_t len, uint8_t *data)
 {
-	uint8_t addr_buf[2];
-	uint8_t num_tries;
+	I2CRequest req = {addrhi, addrlo, len, data, true, I2C_PENDING};
+
+	i2c_submit(&req);
+	i2c_wait(&req);
+	return req.status;
+}
+
+/*
+ * Writes len bytes of data into the EEPROM, starting at byte number pos.
+ * Does not check for page boundaries.
+ * Thin synchronous wrapper around the TWI engine.
+ */
+uint8_t Storage::i2c_write(uint8_t addrhi, uint8_t addrlo, uint8_t len, uint8_t *data)
+{
+	I2CRequest req = {addrhi, addrlo, len, data, false, I2C_PENDING};
+
+	i2c_submit(&req);
+	i2c_wait(&req);
+	return req.status;
+}
+
+/*
+ * The TWI engine carries out transfers in order, so reads and writes issued
+ * after a write-behind always see its data. The data is copied because
+ * callers reuse their buffers (System::receive) or pass pointers to members
+ * which change right after the call (save()).
+ */
+void Storage::writeBehind(uint8_t addrhi, uint8_t addrlo, uint8_t len, uint8_t *data)
+{
+	i2c_wait(&wb_req);
 
-	addr_buf[0] = addrhi;
-	addr_buf[1] = addrlo;
+	memcpy(wb_data, data, len);
+	wb_req.addrhi = addrhi;
+	wb_req.addrlo = addrlo;
+	wb_req.len = len;
+	wb_req.data = wb_data;
+	wb_req.read = false;
+	i2c_submit(&wb_req);
+}
+
+void Storage::flush()
+{
+	i2c_wait(&wb_req);
+}
+
+uint16_t Storage::dirEntry(uint8_t idx)
+{
+	uint8_t entry[2];
+
+#ifdef STORAGE_LOG
+	if (layout == STORAGE_LAYOUT_V3) {
+		uint16_t addr = (log_slot * 512) + entryOffset(idx);
+		i2c_read(addr >> 8, addr & 0xff, 2, entry);
+		return (entry[1] << 8) | entry[0];
+	}
+#endif
+
+	i2c_read(0, 1 + idx, 1, &entry[0]);
+	return entry[0];
+}
+
+#ifdef STORAGE_LOG
+void Storage::reset()
+{
+	uint8_t invalid = 0xff;
 
 	/*
-	 * See comments in i2c_write.
+	 * Keep the stored generation's slot even if it holds no patterns,
+	 * an older generation in the other slot must not come back
 	 */
-	for (num_tries = 0; num_tries < 32; num_tries++) {
-		if (num_tries > 0)
-			_delay_us(500);
+	if ((layout == STORAGE_LAYOUT_V3) && (num_anims != 0xff)) {
+		wr_slot = log_slot ^ 1;
+		first_free_page = log_end;
+	} else {
+		/*
+		 * No valid slot. Patterns in layout version 1 or 2 occupy
+		 * the whole EEPROM, the write below invalidates them.
+		 */
+		wr_slot = 0;
+		first_free_page = 0;
+		if (layout != STORAGE_LAYOUT_V3)
+			num_anims = 0xff;
+	}
+
+	// The slot may still hold an older generation
+	writeBehind(wr_slot * 2, 0, 1, &invalid);
 
-		if (i2c_start_write() != I2C_OK)
-			continue; // EEPROM is busy writing
+	wr_active = true;
+	wr_anims = 0;
+	wr_replace = 0xff;
+	wr_pages = 0;
+	wr_used = 0;
+	wr_limit = STORAGE_V3_PAGES;
+}
 
-		if (i2c_send(2, addr_buf) != 2)
-			continue; // should not happen
+void Storage::edit()
+{
+	if (!wr_active || wr_anims || wr_used
+			|| (layout != STORAGE_LAYOUT_V3) || !hasData())
+		return;
 
-		if (i2c_start_read() != I2C_OK)
-			continue; // should not happen
+	copyEntries(log_slot, 0, wr_slot, 0, num_anims);
+	wr_anims = num_anims;
 
-		if (i2c_receive(len, data) != len)
-			continue; // should not happen
+	// Only the pages from the log head up to its tail are free
+	if (log_start < log_end)
+		wr_limit = STORAGE_V3_PAGES - (log_end - log_start);
+	else
+		wr_limit = log_start - log_end;
+}
+
+void Storage::replace(uint8_t idx)
+{
+	if (idx < wr_anims)
+		wr_replace = idx;
+}
 
-		i2c_stop();
-		return I2C_OK;
+void Storage::remove(uint8_t idx)
+{
+	if (idx < wr_anims) {
+		copyEntries(wr_slot, idx + 1, wr_slot, idx, wr_anims - idx - 1);
+		wr_anims--;
+		wr_replace = 0xff;
 	}
+}
+
+/*
+ * Reads back the entries which were just written. That is fine, the TWI
+ * engine carries out transfers in order.
+ */
+void Storage::copyEntries(uint8_t src, uint8_t src_idx, uint8_t dst, uint8_t dst_idx, uint8_t count)
+{
+	uint8_t buf[16];
+	uint8_t len;
+	uint16_t from, to;
 
-	i2c_stop();
-	return I2C_ERR;
+	while (count) {
+		len = (count < 4) ? count : 4;
+
+		// neither run may cross the version byte, nor a page boundary
+		if ((src_idx < 62) && (src_idx + len > 62))
+			len = 62 - src_idx;
+		if ((dst_idx < 62) && (dst_idx + len > 62))
+			len = 62 - dst_idx;
+		to = (dst * 512) + entryOffset(dst_idx);
+		if ((to % 32) + (len * 4) > 32)
+			len = (32 - (to % 32)) / 4;
+
+		from = (src * 512) + entryOffset(src_idx);
+		i2c_read(from >> 8, from & 0xff, len * 4, buf);
+		writeBehind(to >> 8, to & 0xff, len * 4, buf);
+
+		src_idx += len;
+		dst_idx += len;
+		count -= len;
+	}
 }
 
+void Storage::sync()
+{
+	uint8_t buf[6];
+	uint16_t crc;
+
+	if (!wr_active)
+		return;
+
+	/*
+	 * Commit: the log head and CRC are written last, a commit which is
+	 * interrupted before leaves an invalid slot.
+	 */
+	crc = scanSlot(wr_slot, wr_anims, first_free_page, &log_start);
+	crc = _crc16_update(crc, wr_anims);
+	crc = _crc16_update(crc, log_generation + 1);
+
+	writeBehind(wr_slot * 2, 0, 1, &wr_anims);
+	buf[0] = log_generation + 1;
+	buf[1] = STORAGE_LAYOUT_V3;
+	writeBehind(wr_slot * 2, 254, 2, buf);
+	buf[0] = first_free_page & 0xff;
+	buf[1] = first_free_page >> 8;
+	buf[2] = buf[3] = 0xff;
+	buf[4] = crc & 0xff;
+	buf[5] = crc >> 8;
+	writeBehind(wr_slot * 2 + 1, 250, 6, buf);
+
+	layout = STORAGE_LAYOUT_V3;
+	log_slot = wr_slot;
+	log_generation++;
+	log_end = first_free_page;
+	num_anims = wr_anims;
+	wr_active = false;
+	verifyReset();
+}
+#else
+/*
+ * Layout version 1: a transmission replaces all stored patterns. They remain
+ * until the first page of the new ones is written, so a transmission which
+ * fails before that (e.g. an edit transmission, which needs STORAGE_LOG)
+ * leaves them intact.
+ */
 void Storage::reset()
 {
+	wr_active = true;
+	wr_anims = 0;
+	wr_pages = 0;
 	first_free_page = 0;
-	num_anims = 0;
+}
+
+void Storage::wipe()
+{
+	uint8_t invalid = 0xff;
+
+	if (num_anims != 0xff) {
+		writeBehind(0, 0, 1, &invalid);
+		num_anims = 0xff;
+	}
+	// version 1 never writes byte 255, see above
+	if (layout != STORAGE_LAYOUT_V1) {
+		writeBehind(0, 255, 1, &invalid);
+		layout = STORAGE_LAYOUT_V1;
+	}
 }
 
 void Storage::sync()
 {
-	i2c_write(0, 0, 1, &num_anims);
+	if (!wr_active)
+		return;
+
+	// a transmission without patterns clears the EEPROM as well
+	wipe();
+	writeBehind(0, 0, 1, &wr_anims);
+	num_anims = wr_anims;
+	wr_active = false;
 }
+#endif /* STORAGE_LOG */
 
 bool Storage::hasData()
 {
@@ -260,7 +699,11 @@ bool Storage::hasData()
 
 void Storage::load(uint8_t idx, uint8_t *data)
 {
-	i2c_read(0, 1 + idx, 1, &page_offset);
+	uint16_t addr;
+
+	page_offset = dirEntry(idx);
+	chunk_skip = 0;
+	addr = dataStart() + (page_offset * 32);
 
 	/*
 	 * Unconditionally read 132 bytes. The data buffer must hold at least
@@ -269,54 +712,316 @@ void Storage::load(uint8_t idx, uint8_t *data)
 	 * Also note that the EEPROM automatically wraps around when the end of
 	 * memory is reached, so this edge case doesn't need to be accounted for.
 	 */
-	i2c_read(1 + (page_offset / 8), (page_offset % 8) * 32, 132, data);
+	i2c_read(addr >> 8, addr & 0xff, 132, data);
 }
 
 void Storage::loadChunk(uint8_t chunk, uint8_t *data)
 {
-	uint8_t this_page_offset = page_offset + (4 * chunk);
+	// skip the 4 byte header, chunks may cross page boundaries
+	uint16_t addr = dataStart() + (page_offset * 32) + 4 + chunk_skip + (chunk * 64);
 
-	// Note that we do not load headers here -> 128 instead of 132 bytes
-	i2c_read(1 + (this_page_offset / 8), (this_page_offset % 8) * 32 + 4, 128, data);
+	i2c_wait(&chunk_req);
+
+	chunk_req.addrhi = addr >> 8;
+	chunk_req.addrlo = addr & 0xff;
+	chunk_req.len = 64;
+	chunk_req.data = data;
+	chunk_req.read = true;
+	i2c_submit(&chunk_req);
+}
+
+#ifdef STORAGE_LOG
+void Storage::verifyReset()
+{
+	memset(vf_ok, 0, sizeof(vf_ok));
+	vf_idx = 0xff;
+	vf_next = 0;
+}
+
+void Storage::verifyStart(uint8_t idx)
+{
+	uint8_t header[4];
+	uint16_t addr = 1024 + (dirEntry(idx) * 32);
+
+	i2c_read(addr >> 8, addr & 0xff, 4, header);
+
+	vf_crc = 0xffff;
+	for (uint8_t i = 0; i < 4; i++)
+		vf_crc = _crc16_update(vf_crc, header[i]);
+	vf_left = ((header[0] & 0x0f) << 8) | header[1];
+	vf_addr = addr + 4;
+	vf_idx = idx;
+}
+
+bool Storage::verifyStep()
+{
+	uint8_t buf[16];
+	uint8_t len = (vf_left < sizeof(buf)) ? vf_left : sizeof(buf);
+	uint16_t addr;
+
+	if (len) {
+		i2c_read(vf_addr >> 8, vf_addr & 0xff, len, buf);
+		for (uint8_t i = 0; i < len; i++)
+			vf_crc = _crc16_update(vf_crc, buf[i]);
+		vf_addr += len;
+		vf_left -= len;
+		if (vf_left)
+			return false;
+	}
+
+	// CRC of the pattern: bytes 2 .. 3 of its directory entry
+	addr = (log_slot * 512) + entryOffset(vf_idx) + 2;
+	i2c_read(addr >> 8, addr & 0xff, 2, buf);
+
+	if ((uint16_t)(buf[0] | (buf[1] << 8)) == vf_crc)
+		vf_ok[vf_idx / 8] |= _BV(vf_idx % 8);
+	// verifyIdle() moves on, even if the pattern is corrupt
+	if (vf_idx == vf_next)
+		vf_next++;
+	vf_idx = 0xff;
+	return true;
+}
+
+bool Storage::verifyPart(uint8_t idx)
+{
+	if ((idx >= num_anims) || verified(idx))
+		return true;
+
+	if (vf_idx != idx)
+		verifyStart(idx);
+	return verifyStep();
+}
+
+bool Storage::verified(uint8_t idx)
+{
+	if ((layout != STORAGE_LAYOUT_V3) || !hasData())
+		return true;
+	return vf_ok[idx / 8] & _BV(idx % 8);
+}
+
+bool Storage::verify(uint8_t idx)
+{
+	while (!verifyPart(idx))
+		;
+
+	return verified(idx);
+}
+
+void Storage::verifyIdle()
+{
+	/*
+	 * While a new generation is being written, its pages may be the
+	 * ones of the stored patterns
+	 */
+	if ((layout != STORAGE_LAYOUT_V3) || !hasData() || wr_active)
+		return;
+
+	if (vf_idx == 0xff) {
+		while ((vf_next < num_anims) && verified(vf_next))
+			vf_next++;
+		if (vf_next >= num_anims)
+			return;
+		verifyStart(vf_next);
+	}
+
+	verifyStep();
 }
 
 void Storage::save(uint8_t *data)
 {
+	uint8_t pages = patternPages(data);
+	uint16_t skip = 0;
+
+	wr_pages = 0;
+
 	/*
 	 * Technically, we can store up to 255 patterns. However, Allowing
 	 * 255 patterns (-> num_anims = 0xff) means we can't easily
 	 * distinguish between an EEPROM with 255 patterns and a factory-new
-	 * EEPROM (which just reads 0xff everywhere). So only 254 patterns
-	 * are allowed.
+	 * EEPROM (which just reads 0xff everywhere). A layout version 3
+	 * directory slot has room for 124 entries.
 	 */
-	if (num_anims < 254) {
-		/*
-		* Bytes 0 .. 255 (pages 0 .. 7) are reserved for storage metadata,
-		* first_free_page counts pages starting at byte 256 (page 8).
-		* So, first_free_page == 247 addresses EEPROM bytes 8160 .. 8191.
-		* first_free_page == 248 would address bytes 8192 and up, which don't
-		* exist -> don't save anything afterwards.
-		*
-		* Note that at the moment (stored patterns are aligned to page
-		* boundaries) this means we can actually only store up to 248
-		* patterns.
-		*/
-		if (first_free_page < 248) {
-			num_anims++;
-			i2c_write(0, num_anims, 1, &first_free_page);
-			append(data);
-		}
+	if ((wr_replace == 0xff) && (wr_anims >= STORAGE_V3_ANIMS))
+		return;
+
+	// Patterns are not split at the end of the data area
+	if (first_free_page + pages > STORAGE_V3_PAGES)
+		skip = STORAGE_V3_PAGES - first_free_page;
+
+	// The new patterns must not overwrite each other (see wr_limit)
+	if (wr_used + skip + pages > wr_limit) {
+		wr_replace = 0xff;
+		return;
+	}
+
+	if (skip)
+		first_free_page = 0;
+	wr_used += skip;
+	wr_pattern = first_free_page;
+	wr_pages = pages;
+	wr_crc = 0xffff;
+	wr_left = (((data[0] & 0x0f) << 8) | data[1]) + 4;
+	append(data);
+}
+
+void Storage::append(uint8_t *data)
+{
+	uint16_t addr = 1024 + (first_free_page * 32);
+	uint8_t invalid = 0xff, idx, i, entry[4];
+
+	// save() rejected the pattern, or all of its pages have been written
+	if (!wr_pages)
+		return;
+
+	// The stored patterns are lost once we need their pages
+	if ((layout == STORAGE_LAYOUT_V3) && hasData() && inLog(first_free_page)) {
+		writeBehind(log_slot * 2, 0, 1, &invalid);
+		num_anims = 0xff;
+	}
+
+	// the header indicates the length of the data, but we really don't care
+	// - it's easier to just write the whole page and skip the trailing
+	// garbage when reading.
+	writeBehind(addr >> 8, addr & 0xff, 32, data);
+	for (i = 0; (i < 32) && wr_left; i++, wr_left--)
+		wr_crc = _crc16_update(wr_crc, data[i]);
+	wr_used++;
+	if (++first_free_page == STORAGE_V3_PAGES)
+		first_free_page = 0;
+
+	if (--wr_pages == 0) {
+		// Pattern complete -> add it to the new directory
+		if (wr_replace == 0xff)
+			idx = wr_anims++;
+		else
+			idx = wr_replace;
+		wr_replace = 0xff;
+
+		entry[0] = wr_pattern & 0xff;
+		entry[1] = wr_pattern >> 8;
+		entry[2] = wr_crc & 0xff;
+		entry[3] = wr_crc >> 8;
+		addr = (wr_slot * 512) + entryOffset(idx);
+		writeBehind(addr >> 8, addr & 0xff, 4, entry);
+	}
+}
+
+/*
+ * A carousel image occupies the pages from wr_pattern to first_free_page.
+ * Its pages arrive in any order, so they are placed at once, and
+ * wr_pages == 0 keeps save() and append() out of the way.
+ */
+void Storage::beginImage(uint16_t pages)
+{
+	if (first_free_page + pages > STORAGE_V3_PAGES)
+		first_free_page = 0;
+	wr_pattern = first_free_page;
+	first_free_page += pages;
+	if (first_free_page == STORAGE_V3_PAGES)
+		first_free_page = 0;
+}
+
+void Storage::saveImagePage(uint16_t page, uint8_t *data)
+{
+	uint8_t invalid = 0xff;
+	uint16_t addr;
+
+	page += wr_pattern;
+	addr = 1024 + (page * 32);
+
+	// The stored patterns are lost once we need their pages
+	if ((layout == STORAGE_LAYOUT_V3) && hasData() && inLog(page)) {
+		writeBehind(log_slot * 2, 0, 1, &invalid);
+		num_anims = 0xff;
+	}
+
+	writeBehind(addr >> 8, addr & 0xff, 32, data);
+}
+
+void Storage::saveImageEntries(uint8_t page, uint8_t *data)
+{
+	// directory entries: slot bytes 4 .. 251 and 256 .. 503
+	uint8_t from = (page == 0) ? 4 : 0;
+	uint8_t to = (page == 7) ? 28 : (page == 15) ? 24 : 32;
+	uint16_t addr = (wr_slot * 512) + (page * 32), offset;
+
+	if (page > 15)
+		return;
+
+	for (uint8_t i = from; i < to; i += 4) {
+		offset = (data[i] | (data[i + 1] << 8)) + wr_pattern;
+		data[i] = offset & 0xff;
+		data[i + 1] = offset >> 8;
 	}
+	writeBehind(addr >> 8, (addr & 0xff) + from, to - from, data + from);
+}
+
+void Storage::commitImage(uint8_t count)
+{
+	wr_anims = count;
+	sync();
+}
+#else
+void Storage::save(uint8_t *data)
+{
+	uint8_t pages = patternPages(data);
+
+	wr_pages = 0;
+
+	/*
+	 * 8 bit page offsets address STORAGE_V1_PAGES pages after the
+	 * directory. Each pattern needs at least one of them, so there are
+	 * never 255 patterns (which would look like a factory-new EEPROM).
+	 */
+	if (first_free_page + pages > STORAGE_V1_PAGES)
+		return;
+
+	wipe();
+	wr_pattern = first_free_page;
+	wr_pages = pages;
+	append(data);
 }
 
 void Storage::append(uint8_t *data)
 {
-	// see comment in Storage::save()
-	if (first_free_page < 248) {
-		// the header indicates the length of the data, but we really don't care
-		// - it's easier to just write the whole page and skip the trailing
-		// garbage when reading.
-		i2c_write(1 + (first_free_page / 8), (first_free_page % 8) * 32, 32, data);
-		first_free_page++;
+	uint16_t addr = 256 + (first_free_page * 32);
+	uint8_t entry = wr_pattern;
+
+	// save() rejected the pattern, or all of its pages have been written
+	if (!wr_pages)
+		return;
+
+	writeBehind(addr >> 8, addr & 0xff, 32, data);
+	first_free_page++;
+
+	// Pattern complete -> add it to the directory
+	if (--wr_pages == 0)
+		writeBehind(0, 1 + wr_anims++, 1, &entry);
+}
+#endif /* STORAGE_LOG */
+
+void Storage::discard()
+{
+	// Its directory entry has not been written yet
+	if (wr_pages) {
+#ifdef STORAGE_LOG
+		wr_used -= first_free_page - wr_pattern;
+#endif
+		first_free_page = wr_pattern;
+		wr_pages = 0;
 	}
+#ifdef STORAGE_LOG
+	wr_replace = 0xff;
+#endif
+}
+
+void Storage::cancel()
+{
+	discard();
+	wr_active = false;
+}
+
+ISR(TWI_vect)
+{
+	storage.i2c_interrupt();
 }
@@ -12,76 +12,411 @@
 
 #define I2C_EEPROM_ADDR 0x50
 
+/*
+ * EEPROM size in bytes (24C64: 8192, 24C256: 32768, 24C512: 65536), set by
+ * the Makefile (EEPROM=...)
+ */
+#ifndef STORAGE_SIZE
+#define STORAGE_SIZE 8192UL
+#endif
+
+/*
+ * Storage layout versions (see storage.cc), stored in byte 255. Version 1
+ * (8 bit page pointers) never writes byte 255, so it reads 0xff.
+ */
+#define STORAGE_LAYOUT_V1 0xff
+#define STORAGE_LAYOUT_V3 0x03
+
+/*
+ * Storage layout used for new transmissions. The log-structured version 3
+ * (atomic commit, edit transmissions, pattern CRCs and carousel images) is
+ * only built with STORAGE_LOG (Makefile: STORAGE=log), otherwise patterns are
+ * written in version 1. Version 1 is always read.
+ */
+#ifdef STORAGE_LOG
+#define STORAGE_LAYOUT STORAGE_LAYOUT_V3
+#else
+#define STORAGE_LAYOUT STORAGE_LAYOUT_V1
+#endif
+
+/*
+ * Number of pattern data pages in layout version 1 (8 bit page offsets)
+ */
+#define STORAGE_V1_PAGES 248
+
+/*
+ * Number of pattern data pages in layout version 3
+ */
+#define STORAGE_V3_PAGES ((uint16_t)((STORAGE_SIZE - 1024) / 32))
+
+/*
+ * Maximum number of patterns in layout version 3 (directory entries per
+ * slot, see storage.cc)
+ */
+#define STORAGE_V3_ANIMS 124
+
+/*
+ * Number of transfers which can be queued in the TWI engine
+ * (power of 2)
+ */
+#define I2C_QUEUE_LEN 4
+
+/*
+ * I2C clock frequencies in Hz. With I2C_FAST_MODE (make I2C=fast),
+ * Storage::enable() uses fast mode if the EEPROM works reliably with it and
+ * falls back to standard mode otherwise.
+ */
+#define I2C_STANDARD_HZ 100000UL
+#define I2C_FAST_HZ 400000UL
+
+/*
+ * A busy EEPROM (write cycle, up to 10ms) does not acknowledge its address.
+ * The engine then releases the bus and retries after I2C_RETRY_US (see
+ * Storage::poll), giving up after I2C_TIMEOUT_US.
+ */
+#define I2C_RETRY_US 500
+#define I2C_TIMEOUT_US 20000UL
+#define I2C_MAX_TRIES (I2C_TIMEOUT_US / I2C_RETRY_US)
+
+enum I2CStatus : uint8_t {
+	I2C_OK,
+	I2C_ERR,
+	I2C_PENDING
+};
+
+/**
+ * EEPROM transfer for the interrupt-driven TWI engine, see
+ * Storage::i2c_submit()
+ */
+struct I2CRequest {
+	/**
+	 * EEPROM address (see Storage::i2c_read / Storage::i2c_write)
+	 */
+	uint8_t addrhi;
+	uint8_t addrlo;
+
+	/**
+	 * Number of bytes to transfer (at least 1)
+	 */
+	uint8_t len;
+
+	/**
+	 * Data buffer, must be at least len bytes
+	 */
+	uint8_t *data;
+
+	/**
+	 * true: read from the EEPROM, false: write to it
+	 */
+	bool read;
+
+	/**
+	 * An I2CStatus value, I2C_PENDING until the transfer is done
+	 */
+	volatile uint8_t status;
+};
+
 class Storage {
 	private:
 		/**
-		 * Number of animations on the storage, AKA contents of byte 0x0000.
-		 * A value of 0xff indicates that the EEPROM was never written to
-		 * and therefore contains no animations.
+		 * Number of animations on the storage, AKA contents of byte 0x0000
+		 * (or of the active directory slot, see storage.cc). A value of
+		 * 0xff indicates that the EEPROM was never written to and therefore
+		 * contains no animations.
 		 */
 		uint8_t num_anims;
 
+		/**
+		 * Storage layout version of the stored patterns
+		 * (STORAGE_LAYOUT_V1 or _V3), detected by enable()
+		 */
+		uint8_t layout;
+
 		/**
 		 * Page offset of the pattern read by the last load() call. Used to
 		 * calculate the read address in loadChunk(). The animation this
-		 * offset refers to starts at byte 256 + (32 * page_offset).
+		 * offset refers to starts at byte dataStart() + (32 * page_offset).
+		 */
+		uint16_t page_offset;
+
+		/**
+		 * Number of data bytes which loadChunk() skips, see
+		 * skipChunkData(). Reset by load().
+		 */
+		uint8_t chunk_skip;
+
+#ifdef STORAGE_LOG
+		/**
+		 * Layout version 3: directory slot (0 or 1) and generation of the
+		 * stored patterns, and the data pages they occupy (log_start up to
+		 * excluding log_end, wrapping around at the end of the data area).
+		 */
+		uint8_t log_slot;
+		uint8_t log_generation;
+		uint16_t log_start;
+		uint16_t log_end;
+
+		/**
+		 * Directory slot of the new generation
+		 */
+		uint8_t wr_slot;
+
+		/**
+		 * Pattern which the pattern currently being saved replaces
+		 * (see replace()), 0xff: it is appended
+		 */
+		uint8_t wr_replace;
+#endif
+
+		/**
+		 * true between reset() and sync(), i.e. while a new generation
+		 * of patterns is being written
+		 */
+		bool wr_active;
+
+		/**
+		 * Number of patterns of the new generation
+		 */
+		uint8_t wr_anims;
+
+		/**
+		 * Start page and number of pages still to be written of the
+		 * pattern which is currently being saved (wr_pages == 0: none).
+		 * For a carousel image, wr_pattern is the page its data starts
+		 * at (see beginImage()).
+		 */
+		uint16_t wr_pattern;
+		uint8_t wr_pages;
+
+#ifdef STORAGE_LOG
+		/**
+		 * CRC16 over the header and data of the pattern which is
+		 * currently being saved, and the number of its bytes which
+		 * have not been added to it yet
+		 */
+		uint16_t wr_crc;
+		uint16_t wr_left;
+
+		/**
+		 * Number of data pages the new generation used up so far, and
+		 * how many it may use (less than all of them when editing, see
+		 * edit())
 		 */
-		uint8_t page_offset;
+		uint16_t wr_used;
+		uint16_t wr_limit;
+#endif
 
 		/**
-		 * First free page (excluding the 256 byte metadata area) on the
-		 * EEPROM. Used by save() and append(). This value refers to the
-		 * EEPROM bytes 256 + (32 * first_free_page) and up.
+		 * Next data page to be written by save() and append(). This value
+		 * refers to the EEPROM bytes 1024 + (32 * first_free_page) and up
+		 * (layout version 3), or 256 + (32 * first_free_page) (version 1).
 		 */
-		uint8_t first_free_page;
+		uint16_t first_free_page;
 
-		enum I2CStatus : uint8_t {
-			I2C_OK,
-			I2C_START_ERR,
-			I2C_ADDR_ERR,
-			I2C_ERR
-		};
+		/**
+		 * Start of the pattern data area: byte 256 (layout version 1)
+		 * or 1024 (version 3)
+		 */
+#ifdef STORAGE_LOG
+		uint16_t dataStart() { return (layout == STORAGE_LAYOUT_V3) ? 1024 : 256; };
+#else
+		uint16_t dataStart() { return 256; };
+#endif
 
 		/**
-		 * Sends an I2C start condition and the I2C_EEPROM_ADDR with the
-		 * write flag set.
+		 * Reads the directory entry (start page) of pattern idx.
 		 *
-		 * @return An I2CStatus value indicating success/failure
+		 * @param idx pattern index (starting with 0)
+		 * @return page offset of the pattern, see page_offset
 		 */
-		uint8_t i2c_start_write(void);
+		uint16_t dirEntry(uint8_t idx);
 
+#ifdef STORAGE_LOG
 		/**
-		 * Sends an I2C start condition and the I2C_EEPROM_ADDR with the
-		 * read flag set.
+		 * Reads the directory entries of a layout version 3 slot.
+		 * Calculates the CRC over them and the log head, and finds the
+		 * first page after head which is used by one of the patterns.
 		 *
-		 * @return An I2CStatus value indicating success/failure
+		 * @param slot directory slot (0 or 1)
+		 * @param count number of patterns in the slot
+		 * @param head next data page to be written, see first_free_page
+		 * @param tail set to the first used page (head if there is none)
+		 * @return CRC16 over the directory entries and head
 		 */
-		uint8_t i2c_start_read(void);
+		uint16_t scanSlot(uint8_t slot, uint8_t count, uint16_t head, uint16_t *tail);
 
 		/**
-		 * Sends an I2C stop condition. Does not check for errors.
+		 * Checks a layout version 3 directory slot (version byte and CRC).
+		 *
+		 * @param slot directory slot (0 or 1)
+		 * @param count set to the number of patterns in the slot
+		 * @param generation set to the generation of the slot
+		 * @param log set to the data pages used by the slot (start and
+		 *        end, see log_start and log_end)
+		 * @return true if the slot holds a complete directory
 		 */
-		void i2c_stop(void);
+		bool checkSlot(uint8_t slot, uint8_t *count, uint8_t *generation, uint16_t *log);
 
 		/**
-		 * Sends up to len bytes of data via I2C. i2c_start_write() must
-		 * have been called successfully for this to work.
+		 * Copies directory entries (layout version 3), e.g. to keep the
+		 * stored patterns in the new generation.
 		 *
-		 * @param len number of bytes to send
-		 * @param data pointer to data buffer, must be at least len bytes
-		 * @return number of bytes which were successfully sent (0 .. len)
+		 * @param src source slot
+		 * @param src_idx index of the first entry to copy
+		 * @param dst destination slot
+		 * @param dst_idx index of the first entry to write
+		 * @param count number of entries
+		 */
+		void copyEntries(uint8_t src, uint8_t src_idx, uint8_t dst, uint8_t dst_idx, uint8_t count);
+
+		/**
+		 * Selects the newest valid directory slot of a layout version 3
+		 * EEPROM and reads the position of its patterns.
+		 */
+		void mount();
+
+		/**
+		 * Checks whether a data page belongs to the stored patterns
+		 * (layout version 3).
+		 *
+		 * @param page data page, see first_free_page
+		 * @return true if page lies between log_start and log_end
+		 */
+		bool inLog(uint16_t page);
+#else
+		/**
+		 * Invalidates the stored patterns before the first page of a
+		 * new transmission overwrites them, and turns an EEPROM in
+		 * another layout into version 1.
+		 */
+		void wipe();
+#endif
+
+		/**
+		 * Queue of pending transfers for the interrupt-driven TWI engine.
+		 * i2c_submit() appends at i2c_queue_head, i2c_interrupt() works
+		 * on the request at i2c_queue_tail and removes it when it is
+		 * done. Both indexes are free-running.
+		 */
+		I2CRequest * volatile i2c_queue[I2C_QUEUE_LEN];
+		volatile uint8_t i2c_queue_head;
+		volatile uint8_t i2c_queue_tail;
+
+		/**
+		 * Progress of the current transfer: 0 .. 1 are the address
+		 * bytes, 2 .. len + 1 the data bytes.
+		 */
+		uint8_t i2c_pos;
+
+		/**
+		 * EEPROM address pointer after the last read (the byte after
+		 * the last one read), valid if i2c_addr_valid is set. A read
+		 * starting there skips the address bytes (current address read).
+		 */
+		uint16_t i2c_addr;
+		bool i2c_addr_valid;
+
+		/**
+		 * Number of attempts at the current transfer, see I2C_MAX_TRIES
+		 */
+		uint8_t i2c_tries;
+
+		/**
+		 * Set by i2c_interrupt() when the EEPROM did not acknowledge,
+		 * the current transfer is restarted I2C_RETRY_US after
+		 * i2c_retry_time (Timer1 ticks).
+		 */
+		volatile bool i2c_retry;
+		uint16_t i2c_retry_time;
+
+		/**
+		 * Write-behind buffer: EEPROM writes issued by save(), append()
+		 * and saveImagePage() are copied here and carried out by the TWI
+		 * engine in the background. The next write waits until the
+		 * transfer is done, which takes less than a received page.
+		 */
+		I2CRequest wb_req;
+		uint8_t wb_data[32];
+
+		/**
+		 * Transfer used by loadChunk()
+		 */
+		I2CRequest chunk_req;
+
+#ifdef STORAGE_LOG
+		/**
+		 * Patterns of the stored generation which passed the check
+		 * against their CRC (one bit per pattern). A corrupt pattern is
+		 * checked again whenever it is selected. See verifyPart().
+		 */
+		uint8_t vf_ok[(STORAGE_V3_ANIMS + 7) / 8];
+
+		/**
+		 * Pattern which is being checked (0xff: none), next EEPROM
+		 * address to read, number of bytes left and CRC so far.
+		 * verifyIdle() has checked all patterns before vf_next.
+		 */
+		uint8_t vf_idx;
+		uint8_t vf_next;
+		uint16_t vf_addr;
+		uint16_t vf_left;
+		uint16_t vf_crc;
+
+		/**
+		 * Forgets all CRC checks, e.g. because a new generation of
+		 * patterns has been stored.
+		 */
+		void verifyReset();
+
+		/**
+		 * Starts checking pattern idx: reads its header and sets vf_idx,
+		 * vf_addr, vf_left and vf_crc.
+		 */
+		void verifyStart(uint8_t idx);
+
+		/**
+		 * Reads the next 16 bytes of pattern vf_idx. Once all of them
+		 * have been read, compares the CRC with the directory entry and
+		 * updates vf_ok.
+		 *
+		 * @return true if the check of pattern vf_idx is complete
 		 */
-		uint8_t i2c_send(uint8_t len, uint8_t *data);
+		bool verifyStep();
+#endif
 
 		/**
-		 * Receives up to len bytes of data via I2C. i2c_start_read() must
-		 * have been called successfully for this to work.
+		 * Queues an EEPROM write of up to 32 bytes and returns without
+		 * waiting for it to complete. The data is copied, so the
+		 * caller's buffer may be reused right away. Only waits if the
+		 * previous write-behind transfer is still in progress.
 		 *
-		 * @param len number of bytes to receive
+		 * @param addrhi upper address byte. Must be less than STORAGE_SIZE / 256
+		 * @param addrlo lower address byte
+		 * @param len number of bytes to write (1 .. 32)
 		 * @param data pointer to data buffer, must be at least len bytes
-		 * @return number of bytes which were successfully received (0 .. len)
 		 */
-		uint8_t i2c_receive(uint8_t len, uint8_t *data);
+		void writeBehind(uint8_t addrhi, uint8_t addrlo, uint8_t len, uint8_t *data);
+
+		/**
+		 * Starts (or retries) the current transfer: sends a stop
+		 * condition if the bus is still ours, followed by a start
+		 * condition.
+		 *
+		 * @param stop true if the bus is still ours
+		 */
+		void i2c_start(bool stop);
+
+		/**
+		 * Finishes the current transfer with the given status and
+		 * starts the next one from the queue (if any).
+		 */
+		void i2c_finish(uint8_t status);
+
+		/**
+		 * Waits until req is done. Sleeps while waiting if interrupts
+		 * are enabled, and runs the TWI state machine itself otherwise.
+		 */
+		void i2c_wait(I2CRequest *req);
 
 		/**
 		 * Reads len bytes of data stored on addrhi, addrlo from the EEPROM
@@ -91,7 +426,7 @@ class Storage {
 		 * read reaches the end of the EEPROM memory, it will wrap around to
 		 * byte 0x0000.
 		 *
-		 * @param addrhi upper address byte. Must be less than 32
+		 * @param addrhi upper address byte. Must be less than STORAGE_SIZE / 256
 		 * @param addrlo lower address byte
 		 * @param len number of bytes to read
 		 * @param data pointer to data buffer, must be at least len bytes
@@ -109,7 +444,7 @@ class Storage {
 		 * put the first 16 bytes where they belong, while the second 16
 		 * bytes will wrap around to the first 16 bytes of the page.
 		 *
-		 * @param addrhi upper address byte. Must be less than 32
+		 * @param addrhi upper address byte. Must be less than STORAGE_SIZE / 256
 		 * @param addrlo lower address byte
 		 * @param len number of bytes to write
 		 * @param data pointer to data buffer, must be at least len bytes
@@ -118,28 +453,95 @@ class Storage {
 		uint8_t i2c_write(uint8_t addrhi, uint8_t addrlo, uint8_t len, uint8_t *data);
 
 	public:
-		Storage() { num_anims = 0; first_free_page = 0;};
+#ifdef STORAGE_LOG
+		Storage() { num_anims = 0; first_free_page = 0; layout = STORAGE_LAYOUT; log_slot = log_generation = 0; wr_active = false; wr_pages = 0; wr_replace = 0xff; vf_idx = 0xff; vf_next = 0; i2c_queue_head = i2c_queue_tail = 0; i2c_addr_valid = false; i2c_retry = false;};
+#else
+		Storage() { num_anims = 0; first_free_page = 0; layout = STORAGE_LAYOUT; wr_active = false; wr_pages = 0; i2c_queue_head = i2c_queue_tail = 0; i2c_addr_valid = false; i2c_retry = false;};
+#endif
+
+		/**
+		 * Submits an EEPROM transfer to the interrupt-driven TWI engine
+		 * and returns immediately (unless the queue is full). req->status
+		 * is I2C_PENDING until the transfer is done, req must stay valid
+		 * until then. The same restrictions as for i2c_read() and
+		 * i2c_write() apply.
+		 *
+		 * @param req transfer description
+		 */
+		void i2c_submit(I2CRequest *req);
+
+		/**
+		 * Called by the TWI interrupt service routine whenever the TWI
+		 * module finished a bus operation. Advances the current transfer.
+		 *
+		 * Do not call this function yourself.
+		 */
+		void i2c_interrupt(void);
 
 		/**
 		 * Enables the storage hardware: Configures the internal I2C
-		 * module and reads num_anims from the EEPROM.
+		 * module and reads num_anims and the storage layout version from
+		 * the EEPROM. In layout version 3, the newest complete generation
+		 * of patterns is used.
+		 *
+		 * The I2C clock is set to I2C_STANDARD_HZ. With I2C_FAST_MODE, it
+		 * is set to I2C_FAST_HZ if a read of the directory at that speed
+		 * succeeds and matches the same read at I2C_STANDARD_HZ.
 		 */
 		void enable();
 
 		/**
-		 * Prepares the storage for a complete overwrite by setting the
-		 * number of stored animations to zero. The next save operation
-		 * will get pattern id 0 and overwrite the first stored pattern.
+		 * I2C clock frequency chosen by enable()
 		 *
-		 * Note that this function does not write anything to the
-		 * EEPROM. Use Storage::sync() for that.
+		 * @return clock frequency in kHz
+		 */
+		uint16_t busClock();
+
+		/**
+		 * Starts a new generation of patterns (layout version 3). The
+		 * next save operation will get pattern id 0. The stored patterns
+		 * remain readable until sync() replaces them, unless the new
+		 * patterns need their pages. Patterns in layout version 1 or 2
+		 * are discarded. Without STORAGE_LOG, the new patterns are
+		 * written in layout version 1 and the stored ones are discarded
+		 * by the first save().
 		 */
 		void reset();
 
+#ifdef STORAGE_LOG
+		/**
+		 * Turns the generation started by reset() into an edit of the
+		 * stored patterns: It starts with all of them, save() appends
+		 * patterns to them, replace() and remove() change them. The new
+		 * patterns only use free pages, so the stored patterns remain
+		 * intact until sync(). Must be called before the first save().
+		 * Without stored patterns in layout version 3, this function
+		 * does nothing.
+		 */
+		void edit();
+
 		/**
-		 * Writes the current number of animations (as set by reset() or
-		 * save() to the EEPROM. Required to get a consistent storage state
-		 * after a power cycle.
+		 * Lets the next pattern saved with save() replace pattern idx of
+		 * the new generation instead of being appended to it.
+		 *
+		 * @param idx pattern index (starting with 0)
+		 */
+		void replace(uint8_t idx);
+
+		/**
+		 * Removes pattern idx from the new generation. The following
+		 * patterns move up by one.
+		 *
+		 * @param idx pattern index (starting with 0)
+		 */
+		void remove(uint8_t idx);
+#endif
+
+		/**
+		 * Commits the generation started by reset(): Writes its number
+		 * of patterns and the directory CRC, after which it replaces the
+		 * previously stored patterns, even after a power cycle.
+		 * Does nothing if no generation was started.
 		 */
 		void sync();
 
@@ -169,18 +571,110 @@ class Storage {
 		void load(uint8_t idx, uint8_t *data);
 
 		/**
-		 * Load partial pattern chunk (without header) from EEPROM.
+		 * Load partial pattern chunk (without header) from EEPROM in the
+		 * background. Returns immediately, the chunk is available once
+		 * waitChunk() returns (or a subsequent loadChunk() call was
+		 * made). Only one chunk can be loading at a time. The chunk
+		 * after the one loaded last (or after the data read by load())
+		 * is read from the EEPROM's current address, without sending
+		 * the address again.
 		 *
-		 * @param chunk 128 byte-offset inside pattern (starting with 0)
-		 * @param data pointer to data structure for the pattern. Must be
-		 *        at least 128 bytes
+		 * @param chunk 64 byte-offset inside pattern (starting with 0)
+		 * @param data pointer to data structure for the chunk. Must be
+		 *        at least 64 bytes and stay valid until the chunk is loaded
 		 */
 		void loadChunk(uint8_t chunk, uint8_t *data);
 
+		/**
+		 * Waits until the chunk requested by the last loadChunk() call
+		 * has been loaded.
+		 */
+		void waitChunk() { i2c_wait(&chunk_req); };
+
+		/**
+		 * Makes loadChunk() treat the first bytes of the pattern loaded
+		 * last as part of its header, e.g. for an animation with
+		 * extended metadata (ANIMATION_EXTMETA). Chunk 0 then starts
+		 * at data byte bytes.
+		 *
+		 * @param bytes number of data bytes to skip
+		 */
+		void skipChunkData(uint8_t bytes) { chunk_skip = bytes; };
+
+		/**
+		 * Checks a few bytes of pattern idx against the CRC in its
+		 * directory entry (layout version 3). Call it from the main loop
+		 * until it returns true, verified() then holds the result.
+		 * A pattern which passed is not read again until the next
+		 * generation of patterns is stored. Without STORAGE_LOG, there
+		 * are no CRCs and every pattern passes right away.
+		 *
+		 * @param idx pattern index (starting with 0)
+		 * @return true once the check of pattern idx is complete
+		 */
+#ifdef STORAGE_LOG
+		bool verifyPart(uint8_t idx);
+#else
+		bool verifyPart(uint8_t) { return true; };
+#endif
+
+		/**
+		 * Result of the last check of pattern idx (see verifyPart()).
+		 * Patterns in layout version 1 or 2 have no CRC and always
+		 * pass.
+		 *
+		 * @param idx pattern index (starting with 0)
+		 * @return true if the pattern passed, false if it is corrupt or
+		 *         has not been checked yet
+		 */
+#ifdef STORAGE_LOG
+		bool verified(uint8_t idx);
+#else
+		bool verified(uint8_t) { return true; };
+#endif
+
+		/**
+		 * Checks pattern idx completely (see verifyPart()). Takes as
+		 * long as reading the whole pattern, e.g. for the host tools.
+		 *
+		 * @param idx pattern index (starting with 0)
+		 * @return false if the pattern is corrupt
+		 */
+#ifdef STORAGE_LOG
+		bool verify(uint8_t idx);
+#else
+		bool verify(uint8_t) { return true; };
+#endif
+
+		/**
+		 * Restarts a transfer which the EEPROM did not acknowledge once
+		 * I2C_RETRY_US have passed. Call it from the main loop, so
+		 * background writes continue while the EEPROM is busy.
+		 */
+		void poll();
+
+		/**
+		 * Reads back a few bytes of the first pattern which has not been
+		 * checked by verifyPart() yet. Call it whenever there is nothing else
+		 * to do, so freshly written patterns are checked right after the
+		 * transmission and corrupt ones are found before they are shown.
+		 * Does nothing between reset() and sync().
+		 */
+#ifdef STORAGE_LOG
+		void verifyIdle();
+#else
+		void verifyIdle() {};
+#endif
+
 		/**
 		 * Save (possibly partial) pattern on the EEPROM. 32 bytes of
 		 * dattern data will be read and stored, regardless of the
-		 * pattern header.
+		 * pattern header. The write is carried out in the background,
+		 * the data buffer may be reused as soon as this function
+		 * returns. Subsequent reads and writes see the new data.
+		 * The pattern is added to the new generation (see reset()) once
+		 * all pages indicated by its header have been written, or
+		 * replaces a pattern of it (see replace()).
 		 *
 		 * @param data pattern data. Must be at least 32 bytes
 		 */
@@ -190,10 +684,77 @@ class Storage {
 		 * Continue saving a pattern on the EEPROM. Appends 32 bytes of
 		 * pattern data after the most recently written block of data
 		 * (i.e., to the pattern which is currently being saved).
+		 * Like save(), the write is carried out in the background.
 		 *
 		 * @param data pattern data. Must be at least 32 bytes
 		 */
 		void append(uint8_t *data);
+
+#ifdef STORAGE_LOG
+		/**
+		 * Turns the generation started by reset() into a carousel image
+		 * (see MessageSpecification.md) of the given number of data
+		 * pages, which may be received in any order. Reserves the pages
+		 * for it at the log head (or at the start of the data area if
+		 * they do not fit before its end). Like with save(), the stored
+		 * patterns remain intact until sync() unless the image needs
+		 * their pages.
+		 *
+		 * @param pages number of data pages, at most STORAGE_V3_PAGES
+		 */
+		void beginImage(uint16_t pages);
+
+		/**
+		 * Writes one data page of the carousel image started by
+		 * beginImage(). Like save(), the write is carried out in the
+		 * background.
+		 *
+		 * @param page data page number inside the image
+		 * @param data page data. Must be at least 32 bytes
+		 */
+		void saveImagePage(uint16_t page, uint8_t *data);
+
+		/**
+		 * Writes the directory entries contained in one directory page
+		 * of the carousel image to the new directory slot. The page
+		 * has the layout of a version 3 directory slot page, with page
+		 * offsets relative to the first data page of the image. The
+		 * other bytes of the page are ignored. Modifies data.
+		 *
+		 * @param page directory page number (0 .. 15)
+		 * @param data page data. Must be at least 32 bytes
+		 */
+		void saveImageEntries(uint8_t page, uint8_t *data);
+
+		/**
+		 * Commits the carousel image with the given number of patterns,
+		 * see sync().
+		 *
+		 * @param count number of patterns, at most STORAGE_V3_ANIMS
+		 */
+		void commitImage(uint8_t count);
+#endif
+
+		/**
+		 * Abandons the generation started by reset() without committing
+		 * it, e.g. because the transmission failed. The stored patterns
+		 * remain, unless the new ones needed their pages.
+		 */
+		void cancel();
+
+		/**
+		 * Discard the pattern which is currently being saved (or a
+		 * pending replace()), e.g. because it was not received
+		 * completely. Its pages will be overwritten by the next save
+		 * operation.
+		 */
+		void discard();
+
+		/**
+		 * Waits until all background writes (see save()) are complete,
+		 * e.g. before powering down.
+		 */
+		void flush();
 };
 
 extern Storage storage;
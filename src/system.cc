@@ -13,11 +13,14 @@
  */
 
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
 #include <avr/pgmspace.h>
+#include <util/crc16.h>
 #include <util/delay.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "display.h"
 #include "fecmodem.h"
@@ -32,7 +35,21 @@ System rocket;
 animation_t active_anim;
 
 uint8_t disp_buf[132]; // 4 byte header + 128 byte data
-uint8_t *rx_buf = disp_buf + sizeof(disp_buf) - 33;
+uint8_t *rx_buf = disp_buf + sizeof(disp_buf) - CAROUSEL_BLOCK_LEN;
+
+/*
+ * While receiving, disp_buf only holds flashingPattern (or timeoutPattern)
+ * and rx_buf, so the memory between them is lent to the modem receive buffer
+ * (see Modem::buffer_expand, make BUFFER_EXPAND=1). During a carousel session, its first 32 bytes
+ * hold one bit per image page instead, set once the page has been written.
+ */
+uint8_t *rx_ext = rx_buf - MODEM_BUFFER_SIZE;
+
+/*
+ * Display brightness. Not part of the flashed image, a blank internal EEPROM
+ * (0xff) means full brightness.
+ */
+uint8_t EEMEM eeprom_brightness;
 
 void System::initialize()
 {
@@ -42,6 +59,7 @@ void System::initialize()
 	// Enable pull-ups on PC3 and PC7 (button pins)
 	PORTC |= _BV(PC3) | _BV(PC7);
 
+	display.setBrightness(eeprom_read_byte(&eeprom_brightness));
 	display.enable();
 	modem.enable();
 	storage.enable();
@@ -70,6 +88,12 @@ void System::loadPattern_P(const uint8_t *pattern_ptr)
 {
 	uint8_t i;
 
+	// a chunk of the previous pattern may still be loading into disp_buf
+	storage.waitChunk();
+
+	// replaces the pattern selected by loadPattern(), if it is still pending
+	load_pending = false;
+
 	for (i = 0; i < 4; i++)
 		disp_buf[i] = pgm_read_byte(pattern_ptr + i);
 
@@ -81,7 +105,9 @@ void System::loadPattern_P(const uint8_t *pattern_ptr)
 
 void System::loadPattern_buf(uint8_t *pattern)
 {
-	active_anim.type = (AnimationType)(pattern[0] >> 4);
+	uint16_t step_ms;
+
+	active_anim.type = (AnimationType)((pattern[0] >> 4) & ~ANIMATION_EXTMETA);
 	active_anim.length = (pattern[0] & 0x0f) << 8;
 	active_anim.length += pattern[1];
 
@@ -90,33 +116,249 @@ void System::loadPattern_buf(uint8_t *pattern)
 		active_anim.delay = (pattern[2] & 0x0f );
 		active_anim.direction = pattern[3] >> 4;
 		active_anim.repeat = (pattern[3] & 0x0f);
-	} else if (active_anim.type == AnimationType::FRAMES) {
+		active_anim.planes = 1;
+	} else if ((active_anim.type == AnimationType::FRAMES)
+			|| (active_anim.type == AnimationType::DELTA)) {
 		active_anim.speed = 250 - ((pattern[2] & 0x0f) << 4);
 		active_anim.delay = pattern[3] >> 4;
 		active_anim.direction = 0;
 		active_anim.repeat = (pattern[3] & 0x0f);
+		// 0 (all older patterns) and 1 are both monochrome, DELTA always is
+		active_anim.planes = pattern[2] >> 4;
+		if (!active_anim.planes || (active_anim.planes > DISPLAY_MAX_PLANES)
+				|| (active_anim.type == AnimationType::DELTA))
+			active_anim.planes = 1;
 	}
 
 	active_anim.data = pattern + 4;
+#ifdef DISPLAY_CLOCK
+	active_anim.step_ms = 0;
+#endif
+
+	/*
+	 * Extended metadata: the step interval replaces speed. The display
+	 * expects its data at pattern + 4, so the first two chunks are read
+	 * again without the metadata bytes (only stored patterns have them).
+	 */
+	if (((pattern[0] >> 4) & ANIMATION_EXTMETA) && (active_anim.length >= 2)) {
+		step_ms = (pattern[4] << 8) | pattern[5];
+#ifdef DISPLAY_CLOCK
+		active_anim.step_ms = step_ms;
+		if (step_ms)
+			active_anim.speed = 0;
+#else
+		// speed counts display refreshes of ~2ms, see Display::multiplex()
+		if (step_ms)
+			active_anim.speed = (step_ms > 511) ? 255 : (step_ms < 4) ? 1 : step_ms / 2;
+#endif
+		active_anim.length -= 2;
+		storage.skipChunkData(2);
+		storage.loadChunk(0, active_anim.data);
+		storage.loadChunk(1, active_anim.data + 64);
+		storage.waitChunk();
+	}
+
 	display.show(&active_anim);
 }
 
 void System::loadPattern(uint8_t anim_no)
 {
-	if (storage.hasData()) {
-		storage.load(anim_no, disp_buf);
+	current_anim_no = anim_no;
+	load_pending = true;
+}
+
+/*
+ * The CRC check reads the whole pattern, so it is done a few bytes at a time
+ * while the display and the modem keep running. A pattern which passed
+ * before is shown right away.
+ */
+void System::loadPending()
+{
+	if (!load_pending || !storage.verifyPart(current_anim_no))
+		return;
+
+	load_pending = false;
+
+	if (receiving())
+		return;
+
+	if (!storage.hasData()) {
+		loadPattern_P(emptyPattern);
+	} else if (storage.verified(current_anim_no)) {
+		storage.load(current_anim_no, disp_buf);
 		loadPattern_buf(disp_buf);
 	} else {
-		loadPattern_P(emptyPattern);
+		// don't scroll garbage, but let the user know
+		loadPattern_P(corruptPattern);
 	}
 }
 
+void System::setBrightness(uint8_t level)
+{
+	display.setBrightness(level);
+	eeprom_update_byte(&eeprom_brightness, display.getBrightness());
+}
+
+void System::startTimeout()
+{
+	MCUSR &= ~_BV(WDRF);
+	cli();
+	// watchdog interrupt after 4 seconds
+	WDTCSR = _BV(WDCE) | _BV(WDE);
+	WDTCSR = _BV(WDIE) | _BV(WDP3);
+	sei();
+}
+
+void System::cancelReceive()
+{
+	wdt_disable();
+	storage.cancel();
+#ifdef SYSTEM_CAROUSEL
+	carousel_total = 0;
+	carousel_missing = 0;
+#endif
+}
+
+bool System::receiving()
+{
+#ifdef SYSTEM_CAROUSEL
+	return modem.buffer_expanded() || carousel_missing || (rxExpect == CAROUSEL_DATA);
+#else
+	return modem.buffer_expanded();
+#endif
+}
+
+#ifdef SYSTEM_CAROUSEL
+bool System::receiveCarouselHeader()
+{
+	uint8_t *hdr = carousel_block;
+
+	/*
+	 * hdr[1] pages in total, the first hdr[2] of which are directory
+	 * pages (a directory slot's pages 0 ..), the rest are data pages
+	 */
+	if ((hdr[0] >= hdr[1]) || !hdr[2] || (hdr[2] > CAROUSEL_DIR_PAGES)
+			|| (hdr[1] - hdr[2] > STORAGE_V3_PAGES))
+		return false;
+
+	// Once the session is complete, its bitmap is gone (see rx_ext)
+	if ((hdr[1] == carousel_total) && (hdr[2] == carousel_dir)
+			&& (hdr[3] == carousel_id) && (!carousel_missing
+				|| (rx_ext[hdr[0] / 8] & _BV(hdr[0] % 8))))
+		return false;
+
+	/*
+	 * rx_buf overlaps the pattern data of a stored pattern, so it is
+	 * replaced before the block is received (a session shows
+	 * flashingPattern anyways)
+	 */
+	if (!carousel_missing)
+		loadPattern_P(flashingPattern);
+
+	memcpy(rx_buf, hdr, sizeof(carousel_block));
+	return true;
+}
+
+void System::receiveCarousel()
+{
+	uint16_t crc = 0xffff;
+	uint8_t i;
+
+	for (i = 0; i < CAROUSEL_BLOCK_LEN - 2; i++)
+		crc = _crc16_update(crc, rx_buf[i]);
+
+	if ((rx_buf[CAROUSEL_BLOCK_LEN - 2] != (crc & 0xff))
+			|| (rx_buf[CAROUSEL_BLOCK_LEN - 1] != (crc >> 8))
+			|| ((rx_buf[0] == 0) && (rx_buf[4] > STORAGE_V3_ANIMS))) {
+		// noise which looked like a carousel block, show the pattern again
+		if (!carousel_missing)
+			loadPattern(current_anim_no);
+		return;
+	}
+
+	if ((rx_buf[1] != carousel_total) || (rx_buf[2] != carousel_dir)
+			|| (rx_buf[3] != carousel_id)) {
+		carousel_total = rx_buf[1];
+		carousel_dir = rx_buf[2];
+		carousel_id = rx_buf[3];
+		carousel_missing = carousel_total;
+		memset(rx_ext, 0, 32);
+
+		/*
+		 * The image is a new generation of patterns like a normal
+		 * transmission, so the stored patterns remain until it is
+		 * complete (unless it needs their pages).
+		 */
+		storage.reset();
+		storage.beginImage(carousel_total - carousel_dir);
+	}
+
+	startTimeout();
+
+	if (rx_buf[0] < carousel_dir) {
+		if (rx_buf[0] == 0)
+			carousel_anims = rx_buf[4];
+		storage.saveImageEntries(rx_buf[0], rx_buf + 4);
+	} else {
+		storage.saveImagePage(rx_buf[0] - carousel_dir, rx_buf + 4);
+	}
+
+	rx_ext[rx_buf[0] / 8] |= _BV(rx_buf[0] % 8);
+
+	if (--carousel_missing == 0) {
+		storage.commitImage(carousel_anims);
+		wdt_disable();
+		loadPattern(0);
+	}
+}
+#endif /* SYSTEM_CAROUSEL */
+
 void System::receive(void)
 {
 	static uint8_t rx_pos = 0;
 	static uint16_t remaining_bytes = 0;
 	uint8_t rx_byte = modem.buffer_get();
 
+	/*
+	 * The FEC layer lost track of the Hamming grouping (e.g. because the
+	 * modem dropped a byte) and found it again at a frame marker. Whatever
+	 * we received since the error is garbage, so drop the pattern which
+	 * is currently being received (or announced by REPLACE) and continue
+	 * with the marker. The following patterns are stored normally, but
+	 * END shows the error message, so the loss does not go unnoticed.
+	 * Carousel blocks (Hamming only) are independent of each other, so
+	 * a broken one is simply dropped. A START or CAROUSEL marker begins a new
+	 * transmission (e.g. the sender restarted), which only START1 accepts.
+	 *
+	 * With FEC_RS, an uncorrectable block was dropped, and the FEC layer
+	 * drops the rest of the transmission as well. There is no safe point
+	 * to continue from, so the transmission fails right away: it is never
+	 * committed and the error message is shown.
+	 */
+	if (modem.resynchronized() && (rxExpect != START1)) {
+		storage.discard();
+#ifdef SYSTEM_CAROUSEL
+		// the pattern was replaced for nothing, see receiveCarouselHeader()
+		if ((rxExpect == CAROUSEL_DATA) && !carousel_missing)
+			loadPattern(current_anim_no);
+#endif
+#ifdef FEC_RS
+		if (rxExpect >= NEXT_BLOCK) {
+			cancelReceive();
+			modem.buffer_shrink();
+			loadPattern_P(timeoutPattern);
+		}
+		rxExpect = START1;
+#else
+		if (rxExpect >= NEXT_BLOCK)
+			rx_resync = true;
+		if ((rx_byte == BYTE_START1) || (rx_byte == BYTE_CAROUSEL1))
+			rxExpect = START1;
+		else
+			rxExpect = (rxExpect < NEXT_BLOCK) ? START1 : NEXT_BLOCK;
+#endif
+	}
+
 	/*
 	 * START* and PATTERN* are sync signals, everything else needs to be
 	 * stored on the EEPROM.
@@ -141,37 +383,109 @@ void System::receive(void)
 		case START1:
 			if (rx_byte == BYTE_START1) { 
 				rxExpect = START2;
+#ifdef SYSTEM_CAROUSEL
+			} else if (rx_byte == BYTE_CAROUSEL1) {
+				rxExpect = CAROUSEL2;
+#endif
 			}
 			break;
 		case START2:
+#ifdef FEC_INTERLEAVED
+			if ((rx_byte == BYTE_START2) || (rx_byte == BYTE_START2_INTERLEAVED)) {
+#else
 			if (rx_byte == BYTE_START2) {
+#endif
 				// PORTC ^= _BV(PC2);   // indicate frame start detection
 				rxExpect = NEXT_BLOCK;
+				rx_resync = false;
 				storage.reset();
+#ifdef SYSTEM_CAROUSEL
+				// drops an incomplete carousel session
+				carousel_total = 0;
+				carousel_missing = 0;
+#endif
 				loadPattern_P(flashingPattern);
-				MCUSR &= ~_BV(WDRF);
-				cli();
-				// watchdog interrupt after 4 seconds
-				WDTCSR = _BV(WDCE) | _BV(WDE);
-				WDTCSR = _BV(WDIE) | _BV(WDP3);
-				sei();
+				modem.buffer_expand(rx_ext);
+				startTimeout();
 				} else {
 				if (rx_byte == BYTE_START1)  rxExpect = START2;
 				else rxExpect = START1;
 			}
 			break;
+#ifdef SYSTEM_CAROUSEL
+		case CAROUSEL2:
+			if (rx_byte == BYTE_CAROUSEL2) {
+				rxExpect = CAROUSEL;
+				rx_pos = 0;
+			} else if (rx_byte != BYTE_CAROUSEL1) {
+				rxExpect = START1;
+			}
+			break;
+		case CAROUSEL:
+			carousel_block[rx_pos++] = rx_byte;
+			if (rx_pos == sizeof(carousel_block))
+				rxExpect = receiveCarouselHeader() ? CAROUSEL_DATA : CAROUSEL_SKIP;
+			break;
+		case CAROUSEL_DATA:
+			rx_buf[rx_pos++] = rx_byte;
+			if (rx_pos == CAROUSEL_BLOCK_LEN) {
+				rxExpect = START1;
+				receiveCarousel();
+			}
+			break;
+		case CAROUSEL_SKIP:
+			if (++rx_pos == CAROUSEL_BLOCK_LEN)
+				rxExpect = START1;
+			break;
+#endif
 		case NEXT_BLOCK:
 			if (rx_byte == BYTE_PATTERN1)
 			rxExpect = PATTERN2;
 			else if (rx_byte == BYTE_END) {
 				// PORTC ^= _BV(PC2);   // indicate frame end detection 
 				storage.sync();
-				current_anim_no = 0;
-				loadPattern(0);
+				modem.buffer_clear();   // added to avoid mess with framing bytes
+				modem.buffer_shrink();
+				if (rx_resync)
+					loadPattern_P(timeoutPattern);
+				else
+					loadPattern(0);
 				rxExpect = START1;
 				wdt_disable();
-				modem.buffer_clear();   // added to avoid mess with framing bytes
-			} else rxExpect = START1;
+#ifdef STORAGE_LOG
+			} else if (rx_byte == BYTE_EDIT1) {
+				rxExpect = EDIT2;
+			} else if (rx_byte == BYTE_DELETE) {
+				rxExpect = DELETE_IDX;
+			} else if (rx_byte == BYTE_REPLACE) {
+				rxExpect = REPLACE_IDX;
+#endif
+			} else if (rx_byte == BYTE_BRIGHTNESS) {
+				rxExpect = BRIGHTNESS_LEVEL;
+			} else if (rx_byte != BYTE_PAD) rxExpect = START1;
+			break;
+#ifdef STORAGE_LOG
+		case EDIT2:
+			if (rx_byte == BYTE_EDIT2) {
+				rxExpect = NEXT_BLOCK;
+				storage.edit();
+			} else {
+				rxExpect = START1;
+			}
+			break;
+		case DELETE_IDX:
+			rxExpect = NEXT_BLOCK;
+			storage.remove(rx_byte);
+			wdt_reset();
+			break;
+		case REPLACE_IDX:
+			rxExpect = NEXT_BLOCK;
+			storage.replace(rx_byte);
+			break;
+#endif
+		case BRIGHTNESS_LEVEL:
+			rxExpect = NEXT_BLOCK;
+			setBrightness(rx_byte);
 			break;
 		case PATTERN2:
 			if (rx_byte == BYTE_PATTERN2) {
@@ -260,15 +574,21 @@ void System::loop()
 		*/
 		if ((PINC & (_BV(PC3) | _BV(PC7))) == (_BV(PC3) | _BV(PC7))) {
 			cli();
-			if (btnMask == BUTTON_RIGHT) {
-				current_anim_no = (current_anim_no + 1) % storage.numPatterns();
-				loadPattern(current_anim_no);
+			if (receiving()) {
+				btnMask = BUTTON_NONE;
+			} else if (btnMask == BUTTON_RIGHT) {
+				loadPattern((current_anim_no + 1) % storage.numPatterns());
 			} else if (btnMask == BUTTON_LEFT) {
 				if (current_anim_no == 0)
-					current_anim_no = storage.numPatterns() - 1;
+					loadPattern(storage.numPatterns() - 1);
 				else
-					current_anim_no--;
-				loadPattern(current_anim_no);
+					loadPattern(current_anim_no - 1);
+			} else if (btnMask == BUTTON_BOTH) {
+				// short press on both buttons: 100% -> 50% -> 25% -> 12.5%
+				if (display.getBrightness() == 1)
+					setBrightness(DISPLAY_MAX_BRIGHTNESS);
+				else
+					setBrightness(display.getBrightness() / 2);
 			}
 			btnMask = BUTTON_NONE;
 			sei();
@@ -281,10 +601,23 @@ void System::loop()
 		btn_debounce--;
 	}
 
+	loadPending();
+
 	while (modem.buffer_available()) {
 		receive();
 	}
 
+	// restart EEPROM transfers which were not acknowledged
+	storage.poll();
+
+	/*
+	 * Check the stored patterns while no transmission is going on. Between
+	 * the blocks of a transmission or carousel session, rxExpect is START1
+	 * as well, but the watchdog timeout is running.
+	 */
+	if ((rxExpect == START1) && !(WDTCSR & _BV(WDIE)))
+		storage.verifyIdle();
+
 	display.update();
 }
 
@@ -293,6 +626,11 @@ void System::shutdown()
 	uint8_t i;
 
 	modem.disable();
+	modem.buffer_shrink();
+
+	// an interrupted transmission or carousel session is dropped
+	if (WDTCSR & _BV(WDIE))
+		cancelReceive();
 
 	// show power down image
 	loadPattern_P(shutdownPattern);
@@ -310,6 +648,9 @@ void System::shutdown()
 	// turn off display to indicate we're about to shut down
 	display.disable();
 
+	// don't cut off a pattern which is still being written
+	storage.flush();
+
 	// disable ADC to save power
 	PRR |= _BV(PRADC); 
 
@@ -335,15 +676,21 @@ void System::shutdown()
 	 * Wait for wakeup button(s) to be released to avoid accidentally
 	 * going back to sleep again or switching the active pattern.
 	 */
-	while (!((PINC & _BV(PC3)) && (PINC & _BV(PC7))))
+	while (!((PINC & _BV(PC3)) && (PINC & _BV(PC7)))) {
+		loadPending();
 		display.update();
+	}
 
 	// debounce
 	for (i = 0; i < 100; i++) {
+		loadPending();
 		display.update();
 		_delay_ms(1);
 	}
 
+	// the shutdown combo is not a brightness change
+	btnMask = BUTTON_NONE;
+
 	// enable the ADC !
 	PRR &= ~_BV(PRADC); 
 
@@ -356,8 +703,10 @@ void System::shutdown()
 
 void System::handleTimeout()
 {
+	cancelReceive();
 	modem.disable();
 	modem.buffer_clear();   // added to avoid mess with framing bytes
+	modem.buffer_shrink();
 	modem.enable();
 	rxExpect = START1;
 	current_anim_no = 0;
@@ -18,6 +18,28 @@
 
 #define SHUTDOWN_THRESHOLD 2048
 
+/*
+ * Carousel block (after the two marker bytes): image page index, total
+ * number of image pages, number of directory pages, session ID, 32 bytes of
+ * page data and CRC16 (little endian). See MessageSpecification.md
+ */
+#define CAROUSEL_BLOCK_LEN 38
+
+/*
+ * Maximum number of directory pages of a carousel image (a storage layout
+ * version 3 directory slot)
+ */
+#define CAROUSEL_DIR_PAGES 16
+
+/*
+ * Carousel mode stages its image like a transmission in storage layout
+ * version 3, and Reed-Solomon blocks cannot be found midway through a loop
+ * (see MessageSpecification.md)
+ */
+#if defined(STORAGE_LOG) && !defined(FEC_RS)
+#define SYSTEM_CAROUSEL
+#endif
+
 
 
 /**
@@ -38,6 +60,19 @@ class System {
 		 */
 		uint8_t btn_debounce;
 
+		/**
+		 * loadPattern() selected current_anim_no, which is shown once
+		 * Storage::verifyPart() has checked it
+		 */
+		bool load_pending;
+
+		/**
+		 * Checks a few more bytes of the pattern selected by
+		 * loadPattern() and shows it once the check is complete (or
+		 * an error pattern if it is corrupt). Does nothing if no
+		 * pattern is pending.
+		 */
+		void loadPending(void);
 
 		/**
 		 * Shuts down the entire system. Shows a shutdown animation, waits
@@ -47,6 +82,13 @@ class System {
 		 */
 		void shutdown(void);
 
+		/**
+		 * Sets the display brightness (see Display::setBrightness())
+		 * and stores it in the internal EEPROM, so that it is restored
+		 * by initialize() after a power cycle.
+		 */
+		void setBrightness(uint8_t level);
+
 		/**
 		 * Modem receive function. Maintains the internal state machine
 		 * (see RxExpect)
@@ -70,19 +112,99 @@ class System {
 		 * the global active_anim object with the metadata stored in the
 		 * first four pattern bytes and calls Display::show() to display
 		 * the pattern. The pattern data must not be longer than 128 bytes.
+		 * A pattern selected by loadPattern() which has not been shown
+		 * yet is dropped.
 		 *
 		 * @param pattern_ptr pointer to pattern data in PROGMEM
 		 */
 		void loadPattern_P(const uint8_t *pattern_ptr);
 
+		/**
+		 * (Re)starts the four second watchdog timeout which calls
+		 * handleTimeout() unless it is reset or disabled in time.
+		 */
+		void startTimeout(void);
+
+#ifdef SYSTEM_CAROUSEL
+		/**
+		 * Checks the header of a carousel block in carousel_block.
+		 * Returns false if the rest of the block is not needed (a page
+		 * which has already been received, or a broken header).
+		 * Otherwise, shows the flashing pattern unless a session is
+		 * running, copies the header to rx_buf and returns true.
+		 */
+		bool receiveCarouselHeader(void);
+
+		/**
+		 * Handles a complete carousel block in rx_buf. Checks its CRC,
+		 * starts a new carousel session if its session parameters
+		 * differ from the current one and writes its page to the EEPROM.
+		 * Commits the new patterns once all pages of the session have
+		 * been received, until then the stored ones remain.
+		 */
+		void receiveCarousel(void);
+#endif
+
+		/**
+		 * Drops the transmission or carousel session which is being
+		 * received: stops the timeout and abandons the generation of
+		 * patterns started for it (see Storage::cancel()).
+		 */
+		void cancelReceive(void);
+
+		/**
+		 * True while disp_buf holds received data besides the pattern
+		 * which is shown (see rx_ext). The pattern must not be switched
+		 * then.
+		 */
+		bool receiving(void);
+
+#ifdef SYSTEM_CAROUSEL
+		/**
+		 * Header (image page index, total pages, directory pages,
+		 * session ID) of the carousel block which is being received
+		 */
+		uint8_t carousel_block[4];
+
+		/**
+		 * Session parameters (total pages, directory pages, session ID)
+		 * of the current carousel session. carousel_total == 0 means that
+		 * there is no session.
+		 */
+		uint8_t carousel_total;
+		uint8_t carousel_dir;
+		uint8_t carousel_id;
+
+		/**
+		 * Number of image pages which were not yet received. 0 once the
+		 * current carousel session is complete.
+		 */
+		uint8_t carousel_missing;
+
+		/**
+		 * Number of patterns in the carousel image (byte 0 of image page
+		 * 0). Only written to the EEPROM once the image is complete.
+		 */
+		uint8_t carousel_anims;
+#endif
+
 		enum TransmissionControl : uint8_t {
+			BYTE_PAD = 0x00,
 			BYTE_END = 0x84,
 			// BYTE_START = 0x99,
 			// BYTE_PATTERN = 0xa9,
 			BYTE_START1 = 0xa5,
 			BYTE_START2 = 0x5a,
+			BYTE_START2_INTERLEAVED = 0x5b,
 			BYTE_PATTERN1 = 0x0f,
 			BYTE_PATTERN2 = 0xf0,
+			BYTE_CAROUSEL1 = 0xc3,
+			BYTE_CAROUSEL2 = 0x3c,
+			BYTE_EDIT1 = 0x96,
+			BYTE_EDIT2 = 0x69,
+			BYTE_DELETE = 0xd2,
+			BYTE_REPLACE = 0xe1,
+			BYTE_BRIGHTNESS = 0xb4,
 		};
 
 		enum ButtonMask : uint8_t {
@@ -95,7 +217,15 @@ class System {
 		enum RxExpect : uint8_t {
 			START1,
 			START2,
+			CAROUSEL2,
+			CAROUSEL,
+			CAROUSEL_DATA,
+			CAROUSEL_SKIP,
 			NEXT_BLOCK,
+			EDIT2,
+			DELETE_IDX,
+			REPLACE_IDX,
+			BRIGHTNESS_LEVEL,
 			PATTERN1,
 			PATTERN2,
 			HEADER1,
@@ -109,8 +239,19 @@ class System {
 		RxExpect rxExpect;
 		ButtonMask btnMask;
 
+		/**
+		 * Set if a pattern of the current transmission was lost when the
+		 * FEC layer re-synchronized (see receive()). END then shows the
+		 * "Transmission error" message instead of the first pattern.
+		 */
+		bool rx_resync;
+
 	public:
-		System() { want_shutdown = 0; rxExpect = START1; current_anim_no = 0; btnMask = BUTTON_NONE; btn_debounce = 0;};
+#ifdef SYSTEM_CAROUSEL
+		System() { want_shutdown = 0; rxExpect = START1; current_anim_no = 0; btnMask = BUTTON_NONE; btn_debounce = 0; load_pending = false; carousel_total = 0; carousel_missing = 0; rx_resync = false;};
+#else
+		System() { want_shutdown = 0; rxExpect = START1; current_anim_no = 0; btnMask = BUTTON_NONE; btn_debounce = 0; load_pending = false; rx_resync = false;};
+#endif
 
 		/**
 		 * Initial MCU setup. Turns off unused peripherals to save power
@@ -134,7 +275,9 @@ class System {
 		 * "Transmission error" message. Called by the Watchdog Timeout
 		 * ISR when a transmission was started (2x START received) but not
 		 * properly finished (that is, four seconds passed since the last
-		 * received byte and END byte was receveid).
+		 * received byte and END byte was receveid), or when an incomplete
+		 * carousel session stalled. The carousel session is dropped as
+		 * well, its next block starts it again.
 		 */
 		void handleTimeout(void);
 
@@ -144,11 +287,13 @@ class System {
 		uint8_t current_anim_no;
 
 		/**
-		 * Loads a pattern from the EEPROM and shows it on the display.
-		 * Loads the first 132 bytes (4 bytes header + 128 bytes data) of
-		 * the pattern into the global disp_buf variable, updates the
-		 * global active_anim to reflect the read metadata and calls
-		 * Display::show() to display the pattern.
+		 * Selects a pattern from the EEPROM to be shown on the display.
+		 * Returns right away, the main loop checks the pattern's CRC
+		 * (see Storage::verifyPart()) and then loads the first 132 bytes
+		 * (4 bytes header + 128 bytes data) of the pattern into the
+		 * global disp_buf variable, updates the global active_anim to
+		 * reflect the read metadata and calls Display::show() to display
+		 * the pattern. Until then, the previous pattern remains.
 		 *
 		 * @param pattern_no index of pattern to show
 		 */
@@ -9,27 +9,31 @@ class modem:
 	# sync = [17 * chr(0), 17 * chr(255)]
 
 	sync = 10*chr(128);
-	slow = 72*chr(128);
 
-	# Created short and long faded sine waves - I'm sure there is a better way to do this ;)
-	fastShort = chr(128)
-	for angle in range(18):
-		fastShort = fastShort + chr(128+int(angle*7*math.sin(math.radians(angle*10))))
-	for angle in range(36):
-		fastShort = fastShort + chr(128+int(126*math.sin(math.radians((angle+18)*10))))
-	for angle in range(18):
-		fastShort = fastShort + chr(128+int((126-angle*7)*math.sin(math.radians((angle+54)*10))))
-
-	fastLong = chr(128)
-	for angle in range(18):
-		fastLong = fastLong + chr(128+int(angle*7*math.sin(math.radians(angle*10))))
-	for angle in range(108):
-		fastLong = fastLong + chr(128+int(126*math.sin(math.radians((angle+18)*10))))
-	for angle in range(18):
-		fastLong = fastLong + chr(128+int((126-angle*7)*math.sin(math.radians((angle+126)*10))))
-
-
-	bits =[[slow,2*slow],[fastShort,fastLong]]
+	# The receiver samples at F_CPU / 32 / 13 and runs its tone detector on
+	# blocks of 8 samples, evaluated every 4 samples (one step, see MODEM_* in
+	# src/modem.h). The low tone has one period per block, the high tone two.
+	adcRate = 8000000.0 / 32 / 13
+	blockLength = 8
+	stepLength = 4
+	toneLow = adcRate / 8
+	toneHigh = adcRate / 4
+
+	# Modulation profiles (see MODEM_PROFILE_* in src/modem.h): symbol
+	# lengths in detector steps (symbol i encodes the value i) and bits per
+	# symbol. The preamble and the profile announcement always use profile 0.
+	PROFILE_STANDARD = 0
+	PROFILE_FAST = 1
+	PROFILE_QUAD = 2
+	profiles = [([4, 8], 1), ([3, 6], 1), ([3, 6, 9, 12], 2)]
+	profileAnnounce = 0x60
+
+	# Calibration preamble: 24 short symbols, the receiver measures symbol
+	# length and signal level on them. Three bytes keep the Hamming 2416
+	# grouping intact (0x00 0x00 0x00 is a valid triple).
+	preamble = 3 * [chr(0)]
+
+	bits = [[], []]
 
 	# Variable to alternate high and low
 	hilo = 0
@@ -45,12 +49,44 @@ class modem:
 	_hammingCalculateParityLowNibble = [0,  3,  5,  6,  6,  5,  3,  0,  7,  4,  2,  1,  1,  2,  4,  7]
 	_hammingCalculateParityHighNibble = [0,  9, 10,  3, 11,  2,  1,  8, 12,  5,  6, 15,  7, 14, 13,  4]
 
+	# Reed-Solomon RS(36, 32) over GF(2^8), primitive polynomial 0x11d
+	# (see src/reedsolomon.h). Only used if the firmware was built with
+	# FEC=rs.
+	rsDataLength = 32
+	rsParityLength = 4
+	_gfExp = [0] * 510
+	_gfLog = [0] * 256
+	_x = 1
+	for _i in range(255):
+		_gfExp[_i] = _gfExp[_i + 255] = _x
+		_gfLog[_x] = _i
+		_x <<= 1
+		if _x & 0x100:
+			_x ^= 0x11d
+	del _i, _x
+
 	# Almost nothing here
-	def __init__(self, data=[], parity=True, frequency=48000):
+	def __init__(self, data=[], parity=True, frequency=48000, interleave=False, reedsolomon=False, profile=0):
 		self.data = data
 		self.parity = parity
+		self.interleave = interleave
+		self.reedsolomon = reedsolomon
+		self.profile = profile if profile < len(self.profiles) else 0
 		self.frequency = frequency if frequency in self.supportedFrequencies else 48000
 		self.cnt = 0
+		self.generateSymbols()
+
+	# Generate one tone symbol (a sine of the given frequency lasting
+	# the given number of receiver steps)
+	def tone(self, frequency, steps):
+		length = int(round(steps * self.stepLength * self.frequency / self.adcRate))
+		return "".join(chr(128 + int(126 * math.sin(2 * math.pi * frequency * i / self.frequency))) for i in xrange(length))
+
+	# Precompute the symbols of profile 0 (preamble) and of the selected
+	# profile for the current sample rate
+	def generateSymbols(self):
+		self.preambleBits = [[self.tone(f, steps) for steps in self.profiles[0][0]] for f in (self.toneLow, self.toneHigh)]
+		self.bits = [[self.tone(f, steps) for steps in self.profiles[self.profile][0]] for f in (self.toneLow, self.toneHigh)]
 
 	# Calculate Hamming parity for 12,8 code (12 bit of which 8bit data)
 	def hammingCalculateParity128(self, byte):
@@ -71,13 +107,15 @@ class modem:
 			sound += self.syncsignal()
 		return sound
 
-	# Decode bits to modem signals
-	def modemcode(self, byte):
+	# Decode bits to modem signals (LSB first)
+	def modemcode(self, byte, preamble=False):
+		bits = self.preambleBits if preamble else self.bits
+		width = 1 if preamble else self.profiles[self.profile][1]
 		bleep = ""
-		for x in xrange(8):
+		for x in xrange(8 / width):
 			self.hilo ^= 1
-			bleep += self.bits[self.hilo][byte & 0x01]
-			byte >>= 1
+			bleep += bits[self.hilo][byte & ((1 << width) - 1)]
+			byte >>= width
 		return bleep
 
 	# Return <length> samples of silence
@@ -92,29 +130,115 @@ class modem:
 	def setParity(self, parity):
 		self.parity = parity
 
+	# Set whether to use interleaved mode (requires parity and a message
+	# generated with blinkenrocket.getMessage(interleave=True))
+	def setInterleave(self, interleave):
+		self.interleave = interleave
+
+	# Spread a block of 32 data bytes over 48 raw bytes so that consecutive
+	# raw bits belong to different codewords (see FECModem::block_word in
+	# src/fecmodem.h)
+	def interleaveBlock(self, data):
+		raw = [0] * 48
+		for i in range(16):
+			first, second = ord(data[2*i]), ord(data[2*i+1])
+			parity = self.hammingCalculateParity2416(first, second)
+			bits = []
+			for n in range(8):
+				bits.extend([(first >> n) & 1, (second >> n) & 1])
+			for n in range(4):
+				bits.extend([(parity >> n) & 1, (parity >> (n+4)) & 1])
+			for n in range(24):
+				raw[2*n + i/8] |= bits[n] << (i%8)
+		return map(chr, raw)
+
+	# Set whether to use Reed-Solomon instead of Hamming 2416 parity
+	def setReedSolomon(self, reedsolomon):
+		self.reedsolomon = reedsolomon
+
+	def gfMul(self, a, b):
+		if a == 0 or b == 0:
+			return 0
+		return self._gfExp[self._gfLog[a] + self._gfLog[b]]
+
+	# Return the 4 parity bytes for a block of 32 data bytes, i.e. the
+	# remainder of data * x^4 divided by (x - a^0)(x - a^1)(x - a^2)(x - a^3)
+	def reedSolomonParity(self, data):
+		generator = [1]
+		for i in range(self.rsParityLength):
+			generator = [a ^ self.gfMul(b, self._gfExp[i]) for a, b in zip(generator + [0], [0] + generator)]
+		parity = [0] * self.rsParityLength
+		for byte in data:
+			feedback = ord(byte) ^ parity[0]
+			parity = parity[1:] + [0]
+			for i in range(self.rsParityLength):
+				parity[i] ^= self.gfMul(generator[i + 1], feedback)
+		return map(chr, parity)
+
+	# Set the modulation profile (PROFILE_*)
+	def setProfile(self, profile):
+		self.profile = profile if profile < len(self.profiles) else 0
+		self.generateSymbols()
+
 	# Set the frequency for the audio
 	def setFrequency(self, frequency):
 		self.frequency = frequency if frequency in self.supportedFrequencies else 48000
-
-	# Generates the audio frames based on the data
-	def generateAudioFrames(self):
-		if self.parity:
+		self.generateSymbols()
+
+	# Returns the byte stream as seen by the receiver's modem layer
+	# (that is, with parity bytes if enabled)
+	def generateModemData(self):
+		data = list(self.data)
+		if self.parity and self.reedsolomon:
+			# 32 data bytes + 4 parity bytes per block, the last block is
+			# padded with 0x00
+			data.extend([chr(0)] * (-len(data) % self.rsDataLength))
+			tmpdata = []
+			for index in range(0, len(data), self.rsDataLength):
+				block = data[index:index+self.rsDataLength]
+				tmpdata.extend(block)
+				tmpdata.extend(self.reedSolomonParity(block))
+			data = tmpdata
+		elif self.parity and self.interleave:
+			# the START marker is sent as two plain triples, everything
+			# else in interleaved blocks of 32 data bytes
+			start, rest = data[:4], data[4:]
+			rest.extend([chr(0)] * (-len(rest) % 32))
+			data = []
+			for index in range(0, 4, 2):
+				data.extend(start[index:index+2])
+				data.append(chr(self.hammingCalculateParity2416(ord(start[index]),ord(start[index+1]))))
+			for index in range(0, len(rest), 32):
+				data.extend(self.interleaveBlock(rest[index:index+32]))
+		elif self.parity:
 			tmpdata = []
 			# for uneven length data, we have to append a null byte
-			if not len(self.data) % 2 == 0:
-				self.data.append(chr(0))
+			if not len(data) % 2 == 0:
+				data.append(chr(0))
 			# insert the parity information every two bytes, sorry for the heavy casting
-			for index in range(0, len(self.data), 2):
-				tmpdata.extend(self.data[index:index+2])
-				tmpdata.append(chr(self.hammingCalculateParity2416(ord(self.data[index]),ord(self.data[index+1]))))
-			self.data = tmpdata
+			for index in range(0, len(data), 2):
+				tmpdata.extend(data[index:index+2])
+				tmpdata.append(chr(self.hammingCalculateParity2416(ord(data[index]),ord(data[index+1]))))
+			data = tmpdata
+		return self.preamble + data
+
+	# Generates the audio frames based on the data
+	def generateAudioFrames(self):
 		# generate the audio itself
 		# add sync signal before the data
 		# (some sound cards take a while to produce a proper output signal)
 		sound = self.generateSyncSignal(200)
-		# process the data and insert sync signal every 10 bytes
-		for byte in self.data:
+		data = self.generateModemData()
+		# the preamble and the profile announcement use profile 0
+		for byte in data[:len(self.preamble)]:
+			sound += self.modemcode(ord(byte), preamble=True)
+		if self.profile:
+			sound += self.modemcode(self.profileAnnounce | self.profile, preamble=True)
+		for byte in data[len(self.preamble):]:
 			sound += self.modemcode(ord(byte))
+		# terminate the last symbol with a tone change so that it can be
+		# measured by the receiver
+		sound += self.bits[self.hilo ^ 1][0]
 		# add some sync signals in the end
 		sound += self.generateSyncSignal(100)
 		return sound
@@ -125,7 +249,33 @@ class modem:
 		wav.writeframes(self.generateAudioFrames())
 		wav.close()
 
+	# Save the raw modem byte stream, e.g. as reference for utilities/host
+	def saveModemData(self, filename):
+		with open(filename, 'wb') as f:
+			f.write("".join(self.generateModemData()))
+
 class Frame( object ):
+	# step interval in milliseconds (extended metadata), 0 = use speed
+	interval = 0
+
+	def setInterval(self,interval):
+		self.interval = interval if 0 <= interval < 65536 else 0
+
+	# Extended metadata -> 16 bit step interval (big endian), only sent
+	# with the extended metadata flag (bit 3 of the type) set
+	def getExtMeta(self):
+		if not self.interval:
+			return []
+		return [chr(self.interval >> 8), chr(self.interval & 0xFF)]
+
+	# Frame header: 4 bit type + 12 bit length (including extended metadata)
+	def getTypeLength(self, length, identifier=None):
+		if identifier is None:
+			identifier = self.identifier
+		identifier |= 0x08 if self.interval else 0
+		length += len(self.getExtMeta())
+		return [chr(identifier << 4 | length >> 8), chr(length & 0xFF) ]
+
 	""" Returns the frame information """
 	def getFrameHeader(self):
 		raise NotImplementedError("You should implement this!")
@@ -142,8 +292,10 @@ class textFrame(Frame):
 	# identifier as of message specification: 0001
 	identifier = 0x01
 
-	def __init__(self,text,speed=13,delay=0,direction=0):
+	# interval: step interval in milliseconds instead of speed (0 = off)
+	def __init__(self,text,speed=13,delay=0,direction=0,interval=0):
 		self.text = text
+		self.setInterval(interval)
 		self.setSpeed(speed)
 		self.setDelay(delay)
 		self.setDirection(direction)
@@ -159,7 +311,7 @@ class textFrame(Frame):
 
 	# Frame header: 4 bit type + 12 bit length
 	def getFrameHeader(self):
-		return [chr(self.identifier << 4 | len(self.text) >> 8), chr(len(self.text) & 0xFF) ]
+		return self.getTypeLength(len(self.text))
 
 	# Header -> 4bit speed, 4 bit delay, 4 bit direction, 4 bit zero
 	def getHeader(self):
@@ -169,6 +321,7 @@ class textFrame(Frame):
 		retval = []
 		retval.extend(self.getFrameHeader())
 		retval.extend(self.getHeader())
+		retval.extend(self.getExtMeta())
 		retval.extend(list(self.text))
 		return retval
 
@@ -176,16 +329,27 @@ class animationFrame(Frame):
 	animation = []
 	speed = 0
 	delay = 0
+	planes = 1
 	# identifier as per specification: 0010	
 	identifier = 0x02
-
-	def __init__(self,animation,speed=13,delay=0):
+	# delta compressed frames: 0011
+	deltaIdentifier = 0x03
+
+	# planes > 1: grayscale animation with that many brightness bits per
+	# pixel, each frame holds one 8 byte bit plane per bit (LSB first)
+	# interval: frame interval in milliseconds instead of speed (0 = off)
+	def __init__(self,animation,speed=13,delay=0,planes=1,interval=0):
+		self.setInterval(interval)
+		self.setPlanes(planes)
 		self.setAnimation(animation)
 		self.setSpeed(speed)
 		self.setDelay(delay)
 
+	def setPlanes(self,planes):
+		self.planes = planes if planes in [1,2,3] else 1
+
 	def setAnimation(self,animation):
-		if len(animation) % 8 is not 0:
+		if len(animation) % (8 * self.planes) is not 0:
 			raise Exception
 		else:
 			self.animation = animation
@@ -196,29 +360,75 @@ class animationFrame(Frame):
 	def setDelay(self,delay):
 		self.delay = delay if delay < 16 else 0
 
+	# Each frame as a mask of the columns which differ from the previous
+	# frame (a blank one for the first frame), followed by the XOR of the
+	# old and new value of each of these columns
+	def getDeltaAnimation(self):
+		retval = []
+		previous = [0] * 8
+		for offset in range(0, len(self.animation), 8):
+			frame = map(ord, self.animation[offset:offset+8])
+			changes = [frame[i] ^ previous[i] for i in range(8) if frame[i] != previous[i]]
+			retval.append(chr(sum(1 << i for i in range(8) if frame[i] != previous[i])))
+			retval.extend(map(chr, changes))
+			previous = frame
+		return retval
+
+	# Returns type and data, delta compressed if that is shorter
+	# (monochrome animations only)
+	def getAnimationData(self):
+		if self.planes == 1:
+			delta = self.getDeltaAnimation()
+			if len(delta) < len(self.animation):
+				return self.deltaIdentifier, delta
+		return self.identifier, self.animation
+
 	# Frame header: 4 bit type + 12 bit length
 	def getFrameHeader(self):
-		return [chr(self.identifier << 4 | len(self.animation) >> 8), chr(len(self.animation) & 0xFF) ]
+		identifier, data = self.getAnimationData()
+		return self.getTypeLength(len(data), identifier)
 
-	# Header -> 4bit zero, 4bit speed, 4 bit zero, 4 bit direction
+	# Header -> 4bit planes (0 = monochrome), 4bit speed, 4 bit zero, 4 bit direction
 	def getHeader(self):
-		return [chr(self.speed), chr(self.delay)]
+		planes = self.planes if self.planes > 1 else 0
+		return [chr(planes << 4 | self.speed), chr(self.delay)]
 
 	def getRepresentation(self):
 		retval = []
 		retval.extend(self.getFrameHeader())
 		retval.extend(self.getHeader())
-		retval.extend(self.animation)
+		retval.extend(self.getExtMeta())
+		retval.extend(self.getAnimationData()[1])
 		return retval
 
+# Converts a grayscale frame to bit planes for animationFrame. columns holds
+# eight columns (leftmost first) of eight brightness values each (in the
+# order of the column byte's bits, LSB first), from 0 (off) to
+# 2**planes - 1 (full brightness).
+def grayscalePlanes(columns, planes):
+	retval = []
+	for plane in range(planes):
+		for column in columns:
+			retval.append(chr(sum(((value >> plane) & 1) << row for row, value in enumerate(column))))
+	return retval
+
 
 class blinkenrocket():
 	eeprom_size = 65536
 	startcode1 = chr(0xA5)
 	startcode2 = chr(0x5A)
+	startcode2interleaved = chr(0x5B)
 	patterncode1 = chr(0x0f)
 	patterncode2 = chr(0xf0)
 	endcode = chr(0x84)
+	padcode = chr(0x00)
+	carouselcode1 = chr(0xC3)
+	carouselcode2 = chr(0x3C)
+	editcode1 = chr(0x96)
+	editcode2 = chr(0x69)
+	deletecode = chr(0xD2)
+	replacecode = chr(0xE1)
+	brightnesscode = chr(0xB4)
 	frames = []
 
 	def __init__(self,eeprom_size=65536):
@@ -230,14 +440,150 @@ class blinkenrocket():
 		else:
 			self.frames.append(frame)
 
-	def getMessage(self):
-		output = [self.startcode1, self.startcode1, self.startcode1, self.startcode2]
+	# brightness: display brightness in eighths (1 .. 8) to set along with
+	# the patterns, None keeps the rocket's setting
+	def getMessage(self, interleave=False, brightness=None):
+		output = [self.startcode1, self.startcode1, self.startcode1, self.startcode2interleaved if interleave else self.startcode2]
+		if brightness is not None:
+			output.extend([self.brightnesscode, chr(brightness)])
 		for frame in self.frames:
-			output.extend([self.patterncode1,self.patterncode2])
-			output.extend(frame.getRepresentation())
+			output.extend(self.getPattern(frame))
 		output.extend([self.endcode,self.endcode,self.endcode])
 		return output
 
+	def getPattern(self, frame):
+		output = [self.patterncode1,self.patterncode2]
+		output.extend(frame.getRepresentation())
+		# keep every marker aligned to a Hamming 2416 triple so that the
+		# receiver can resynchronize on it
+		if len(output) % 2:
+			output.append(self.padcode)
+		return output
+
+	# Returns a transmission which edits the patterns stored on the rocket
+	# instead of replacing them, see MessageSpecification.md. operations is
+	# a list of ('append', frame), ('replace', index, frame),
+	# ('delete', index) and ('brightness', level) tuples, which are applied
+	# in order. Indexes refer to the patterns as changed by the preceding
+	# operations.
+	def getEditMessage(self, operations, interleave=False):
+		output = [self.startcode1, self.startcode1, self.startcode1, self.startcode2interleaved if interleave else self.startcode2]
+		output.extend([self.editcode1, self.editcode2])
+		for operation in operations:
+			if operation[0] == 'append':
+				output.extend(self.getPattern(operation[1]))
+			elif operation[0] == 'replace':
+				output.extend([self.replacecode, chr(operation[1])])
+				output.extend(self.getPattern(operation[2]))
+			elif operation[0] == 'delete':
+				output.extend([self.deletecode, chr(operation[1])])
+			elif operation[0] == 'brightness':
+				output.extend([self.brightnesscode, chr(operation[1])])
+			else:
+				raise RuntimeError("Unknown edit operation")
+		output.extend([self.endcode,self.endcode,self.endcode])
+		return output
+
+	# CRC16 as calculated by avr-libc's _crc16_update (initial value 0xffff)
+	def crc16(self, data):
+		crc = 0xffff
+		for byte in data:
+			crc ^= ord(byte)
+			for i in range(8):
+				crc = (crc >> 1) ^ 0xA001 if crc & 1 else crc >> 1
+		return crc
+
+	# Returns the EEPROM contents (see src/storage.cc) for all frames as
+	# directory pages and data pages in storage layout version 1 (8 bit page
+	# offsets, readable by every firmware). Larger images need layout
+	# version 3, see getEEPROMImage().
+	def getStorageImage(self):
+		offsets = []
+		data = []
+		for frame in self.frames:
+			offsets.append(len(data) / 32)
+			data.extend(frame.getRepresentation())
+			data.extend([chr(0xff)] * (-len(data) % 32))
+		if len(self.frames) > 248:
+			raise RuntimeError("Too many frames")
+		if len(data) / 32 > 248 or 256 + len(data) > self.eeprom_size:
+			raise RuntimeError("Frames do not fit into the EEPROM")
+		directory = [chr(len(self.frames))] + [chr(offset) for offset in offsets]
+		directory.extend([chr(0xff)] * (-len(directory) % 32))
+		return directory, data
+
+	# Returns the complete EEPROM contents (eeprom_size bytes, see
+	# src/storage.cc) for all frames, e.g. for an EEPROM programmer. Layout
+	# version 3 is the one the firmware writes (with a CRC for every
+	# pattern), layout version 1 the one of getStorageImage().
+	def getEEPROMImage(self, layout=3):
+		if layout != 3:
+			directory, data = self.getStorageImage()
+			image = directory + [chr(0xff)] * (-len(directory) % 256) + data
+		else:
+			pages = (self.eeprom_size - 1024) / 32
+			slot = [chr(0xff)] * 512
+			entries = []
+			data = []
+			if len(self.frames) > 124:
+				raise RuntimeError("Too many frames")
+			for index, frame in enumerate(self.frames):
+				offset = len(data) / 32
+				crc = self.crc16(frame.getRepresentation())
+				entries.extend([chr(offset & 0xff), chr(offset >> 8), chr(crc & 0xff), chr(crc >> 8)])
+				position = 4 + 4 * index + (4 if index >= 62 else 0)
+				slot[position:position+4] = entries[-4:]
+				data.extend(frame.getRepresentation())
+				data.extend([chr(0xff)] * (-len(data) % 32))
+			if len(data) / 32 > pages:
+				raise RuntimeError("Frames do not fit into the EEPROM")
+			# log head: the next transmission starts after the patterns
+			head = len(data) / 32 % pages
+			generation = 1
+			slot[0] = chr(len(self.frames))
+			slot[254] = chr(generation)
+			slot[255] = chr(0x03)
+			slot[506:508] = [chr(head & 0xff), chr(head >> 8)]
+			crc = self.crc16(entries + slot[506:508] + [slot[0], slot[254]])
+			slot[510:512] = [chr(crc & 0xff), chr(crc >> 8)]
+			image = slot + [chr(0xff)] * 512 + data
+		if len(image) > self.eeprom_size:
+			raise RuntimeError("Frames do not fit into the EEPROM")
+		return image + [chr(0xff)] * (self.eeprom_size - len(image))
+
+	# Returns a broadcast transmission which repeats the storage image
+	# loops times as self-contained carousel blocks (one per page), see
+	# MessageSpecification.md. Receivers may join at any time and finish
+	# once they have collected every page. The image consists of the
+	# directory slot pages of storage layout version 3 which hold entries
+	# (with page offsets relative to the first data page) and the data pages.
+	def getCarousel(self, loops=3, session=None):
+		if len(self.frames) > 124:
+			raise RuntimeError("Too many frames")
+		slot = [chr(0xff)] * 512
+		data = []
+		for index, frame in enumerate(self.frames):
+			offset = len(data) / 32
+			crc = self.crc16(frame.getRepresentation())
+			position = 4 + 4 * index + (4 if index >= 62 else 0)
+			slot[position:position+4] = [chr(offset & 0xff), chr(offset >> 8), chr(crc & 0xff), chr(crc >> 8)]
+			data.extend(frame.getRepresentation())
+			data.extend([chr(0xff)] * (-len(data) % 32))
+		slot[0] = chr(len(self.frames))
+		dirpages = (position + 4 + 31) / 32 if self.frames else 1
+		pages = slot[:32*dirpages] + data
+		total = len(pages) / 32
+		if total > 255 or len(data) / 32 > (self.eeprom_size - 1024) / 32:
+			raise RuntimeError("Storage image too large for carousel mode")
+		if session is None:
+			session = self.crc16(pages) & 0xff
+		blocks = []
+		for index in range(total):
+			block = [chr(index), chr(total), chr(dirpages), chr(session)]
+			block.extend(pages[32*index:32*index+32])
+			crc = self.crc16(block)
+			blocks.extend([self.carouselcode1, self.carouselcode2] + block + [chr(crc & 0xff), chr(crc >> 8)])
+		return blocks * loops
 
 
 
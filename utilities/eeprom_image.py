@@ -0,0 +1,117 @@
+#!/usr/bin/env python
+#
+# Writes an EEPROM image with the given patterns for programming rockets
+# with an EEPROM programmer instead of an audio transmission. Each argument
+# is a text pattern, or an animation if it starts with "anim:" followed by
+# the frame bytes in hex (8 bytes per frame, e.g. anim:ff818181818181ff).
+# anim2: and anim3: start grayscale animations with 2 or 3 bit planes of
+# 8 bytes each per frame, least significant plane first.
+# Output files ending with .hex are written in Intel HEX format, all others
+# as raw binary. The image always covers the whole EEPROM.
+#
+# -s: EEPROM size in bytes (8192 = 24c64, 32768 = 24c256, 65536 = 24c512)
+# -l: storage layout version, 1 (default, readable by every firmware build)
+#     or 3 (with pattern CRCs, only read by firmware built with STORAGE=log,
+#     which is needed for EEPROMs larger than 8 KiB), see src/storage.cc
+# -c: check the image by reading it back with the firmware's storage code
+#     (host/storage_dump, run "make" in host/ first)
+#
+# Usage: eeprom_image.py [-s size] [-l layout] [-c] <out.bin|out.hex> <pattern> ...
+
+import getopt
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+from blinkenrocket import *
+
+dumpers = {
+	8192: 'storage_dump',
+	32768: 'storage_dump_24c256',
+	65536: 'storage_dump_24c512',
+}
+
+def parsePattern(argument):
+	match = re.match('anim([23]?):', argument)
+	if match:
+		planes = int(match.group(1) or 1)
+		return animationFrame(list(argument[match.end():].decode('hex')), planes=planes)
+	return textFrame(argument)
+
+# Intel HEX records with 16 data bytes each. EEPROMs larger than 64 KiB
+# would need extended address records, we don't have any.
+def intelHex(image):
+	lines = []
+	for address in range(0, len(image), 16):
+		record = [16, address >> 8, address & 0xff, 0x00] + map(ord, image[address:address+16])
+		record.append(-sum(record) & 0xff)
+		lines.append(':' + ''.join('%02X' % byte for byte in record))
+	lines.append(':00000001FF')
+	return '\n'.join(lines) + '\n'
+
+def readIntelHex(text):
+	image = []
+	for line in text.splitlines():
+		record = map(ord, line[1:].decode('hex'))
+		if sum(record) & 0xff:
+			raise RuntimeError('Intel HEX checksum error')
+		if record[3] == 0x00:
+			address = record[1] << 8 | record[2]
+			image.extend([chr(0xff)] * (address + record[0] - len(image)))
+			image[address:address+record[0]] = map(chr, record[4:-1])
+	return ''.join(image)
+
+# Reads the patterns back from the image file with storage_dump and
+# compares them to the frames. Returns the number of mismatches.
+def check(filename, size, frames):
+	dumper = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'host', dumpers[size])
+	output = subprocess.Popen([dumper, filename], stdout=subprocess.PIPE).communicate()[0]
+	patterns = [line.split() for line in output.splitlines()]
+	errors = abs(len(patterns) - len(frames))
+	for pattern, frame in zip(patterns, frames):
+		if pattern[1] != 'ok' or pattern[2] != ''.join(frame.getRepresentation()).encode('hex'):
+			print 'pattern %s: %s, read back %s' % (pattern[0], pattern[1], pattern[2])
+			errors += 1
+	return errors
+
+if __name__ == '__main__':
+	size = 8192
+	layout = 1
+	verify = False
+	usage = 'Usage: %s [-s size] [-l layout] [-c] <out.bin|out.hex> <pattern> ...' % sys.argv[0]
+
+	try:
+		options, arguments = getopt.getopt(sys.argv[1:], 's:l:c')
+	except getopt.GetoptError:
+		sys.exit(usage)
+	for option, value in options:
+		if option == '-s':
+			size = int(value)
+		elif option == '-l':
+			layout = int(value)
+		elif option == '-c':
+			verify = True
+	if len(arguments) < 2 or size not in dumpers or layout not in [1, 3]:
+		sys.exit(usage)
+
+	b = blinkenrocket(eeprom_size=size)
+	b.frames = [parsePattern(argument) for argument in arguments[1:]]
+	image = ''.join(b.getEEPROMImage(layout))
+
+	if arguments[0].endswith('.hex'):
+		open(arguments[0], 'w').write(intelHex(image))
+	else:
+		open(arguments[0], 'wb').write(image)
+
+	if verify:
+		binary = arguments[0]
+		if binary.endswith('.hex'):
+			binary = tempfile.mkstemp(suffix='.bin')[1]
+			open(binary, 'wb').write(readIntelHex(open(arguments[0]).read()))
+		errors = check(binary, size, b.frames)
+		if binary != arguments[0]:
+			os.remove(binary)
+		print '%d patterns, %d errors' % (len(b.frames), errors)
+		sys.exit(1 if errors else 0)
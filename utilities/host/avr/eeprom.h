@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for <avr/eeprom.h>. EEMEM variables are ordinary (zero
+ * initialized) variables, so the internal EEPROM starts out blank and is
+ * not preserved between runs.
+ */
+
+#ifndef HOST_AVR_EEPROM_H_
+#define HOST_AVR_EEPROM_H_
+
+#include <avr/io.h>
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p)
+{
+	return *p;
+}
+
+static inline void eeprom_update_byte(uint8_t *p, uint8_t value)
+{
+	*p = value;
+}
+
+#endif /* HOST_AVR_EEPROM_H_ */
@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for <avr/interrupt.h>. Interrupt vectors become plain
+ * functions which the simulation calls directly. sei() and cli() only
+ * maintain the I flag in SREG, the bench checks it before dispatching
+ * TWI_vect.
+ */
+
+#ifndef HOST_AVR_INTERRUPT_H_
+#define HOST_AVR_INTERRUPT_H_
+
+#define ISR(vector) extern "C" void vector(void); void vector(void)
+
+#include <avr/io.h>
+
+#define sei() (SREG |= _BV(SREG_I))
+#define cli() (SREG &= ~_BV(SREG_I))
+
+#endif /* HOST_AVR_INTERRUPT_H_ */
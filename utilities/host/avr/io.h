@@ -0,0 +1,112 @@
+/*
+ * Host stand-in for <avr/io.h>. Registers are plain variables defined in
+ * avr_sim.cc, so firmware sources can be compiled and run on a PC.
+ */
+
+#ifndef HOST_AVR_IO_H_
+#define HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t PORTA, DDRA, PINA;
+extern volatile uint8_t PORTB, DDRB, PINB;
+extern volatile uint8_t PORTC, DDRC, PINC;
+extern volatile uint8_t PORTD, DDRD, PIND;
+
+extern volatile uint8_t ADCSRA, ADMUX;
+extern volatile uint16_t ADC;
+
+extern volatile uint8_t TCCR0A, TIMSK0, TIFR0, TCNT0, OCR0A, OCR0B;
+extern volatile uint8_t TCCR1A, TCCR1B, TCNT1L, TIMSK1, TIFR1;
+extern volatile uint16_t ICR1, OCR1A, OCR1B, TCNT1;
+extern volatile uint8_t ACSR, ADCSRB;
+
+extern volatile uint8_t SPCR, SPDR;
+extern volatile uint8_t PRR, SMCR, MCUSR, WDTCSR, SREG;
+extern volatile uint8_t PCICR, PCMSK1, PCMSK3;
+
+/*
+ * TWI (I2C) control register. Writes to it drive the simulated I2C EEPROM
+ * in avr_sim.cc, all other TWI registers are plain variables. A bus
+ * operation takes nine SCL periods (derived from TWBR), TWINT is set once
+ * it is complete. Reading TWCR while an operation is in progress advances
+ * the simulated time, so busy-waiting on TWINT works.
+ */
+struct HostTWCR {
+	uint8_t value;
+	HostTWCR &operator=(uint8_t v);
+	operator uint8_t();
+};
+
+extern HostTWCR TWCR;
+extern volatile uint8_t TWSR, TWDR, TWBR;
+
+/*
+ * Sets TWINT if the current TWI operation is complete. Returns true if
+ * TWINT was set by this call (i.e., TWI_vect is due).
+ */
+bool host_twi_poll(void);
+
+/*
+ * Simulated time in microseconds, advanced by the test bench. _delay_us()
+ * and TWI transfers call host_delay(), which lets the bench run the
+ * interrupts which would have happened in the meantime (see
+ * host_delay_hook).
+ */
+extern volatile uint32_t host_time_us;
+extern void (*host_delay_hook)(uint32_t us);
+void host_delay(uint32_t us);
+
+/*
+ * Simulated I2C EEPROM (address 0x50) with 32 byte pages and a 5ms write
+ * cycle. 8 KiB unless the firmware is built for a larger one (STORAGE_SIZE,
+ * see storage.h).
+ */
+#ifdef STORAGE_SIZE
+#define HOST_EEPROM_SIZE STORAGE_SIZE
+#else
+#define HOST_EEPROM_SIZE 8192
+#endif
+extern uint8_t host_eeprom[HOST_EEPROM_SIZE];
+extern uint32_t host_eeprom_writes;
+extern uint32_t host_eeprom_bytes;
+extern uint32_t host_eeprom_last_write;
+
+/*
+ * Highest SCL frequency the simulated EEPROM works with (default 400kHz).
+ * Faster transfers corrupt the data bytes.
+ */
+extern uint32_t host_twi_max_hz;
+
+enum {
+	PA0 = 0, PA1, PA2, PA3,
+	PC0 = 0, PC1, PC2, PC3, PC4, PC5, PC6, PC7,
+};
+
+enum { ADPS0 = 0, ADPS1, ADPS2, ADIE, ADIF, ADATE, ADSC, ADEN };
+enum { REFS0 = 6 };
+enum { TOIE0 = 0, OCIE0A, OCIE0B };
+enum { TOV0 = 0, OCF0A, OCF0B };
+enum { CS10 = 0, CS11, CS12, WGM12, WGM13, ICES1 = 6, ICNC1 };
+enum { TOIE1 = 0, OCIE1A, OCIE1B, ICIE1 = 5 };
+enum { TOV1 = 0, OCF1A, OCF1B, ICF1 = 5 };
+enum { ACIS0 = 0, ACIS1, ACIC, ACIE, ACI, ACO, ACBG, ACD };
+enum { ACME = 6 };
+enum { CS00 = 0, CS01, CS02, CTC0 };
+enum { SPR0 = 0, SPR1, CPHA, CPOL, MSTR, DORD, SPE, SPIE };
+enum { PRADC = 0 };
+enum { SE = 0, SM0, SM1 };
+enum { WDRF = 3 };
+enum { WDP0 = 0, WDP1, WDP2, WDE, WDCE, WDP3, WDIE, WDIF };
+enum { PCIE0 = 0, PCIE1, PCIE2, PCIE3 };
+enum { PCINT11 = 3, PCINT15 = 7, PCINT24 = 0 };
+enum { TWIE = 0, TWEN = 2, TWWC, TWSTO, TWSTA, TWEA, TWINT };
+enum { SREG_I = 7 };
+
+#endif /* HOST_AVR_IO_H_ */
@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for <avr/pgmspace.h>. There is only one address space.
+ */
+
+#ifndef HOST_AVR_PGMSPACE_H_
+#define HOST_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+
+#define PROGMEM
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define pgm_read_ptr(addr) (*(void * const *)(addr))
+
+#endif /* HOST_AVR_PGMSPACE_H_ */
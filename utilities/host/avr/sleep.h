@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for <avr/sleep.h>. Sleeping lets the simulated time pass
+ * until the bench has run the next interrupts.
+ */
+
+#ifndef HOST_AVR_SLEEP_H_
+#define HOST_AVR_SLEEP_H_
+
+#include <avr/io.h>
+
+static inline void sleep_cpu(void)
+{
+	host_delay(1);
+}
+
+#endif /* HOST_AVR_SLEEP_H_ */
@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for <avr/wdt.h>. The watchdog is simulated by the test
+ * bench (see host_wdt_ticks in avr_sim.cc).
+ */
+
+#ifndef HOST_AVR_WDT_H_
+#define HOST_AVR_WDT_H_
+
+#include <avr/io.h>
+
+extern volatile uint32_t host_wdt_ticks;
+
+static inline void wdt_reset(void)
+{
+	host_wdt_ticks = 0;
+}
+
+static inline void wdt_disable(void)
+{
+	WDTCSR = 0;
+	host_wdt_ticks = 0;
+}
+
+#endif /* HOST_AVR_WDT_H_ */
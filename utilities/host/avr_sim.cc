@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2016 by Birte Kristina Friesel
+ *
+ * License: You may use, redistribute and/or modify this file under the terms
+ * of either:
+ * * The GNU LGPL v3 (see COPYING and COPYING.LESSER), or
+ * * The 3-clause BSD License (see COPYING.BSD)
+ *
+ */
+
+#include <avr/io.h>
+
+/*
+ * Register file of the simulated ATtiny88. Only the registers used by the
+ * firmware are provided.
+ */
+
+volatile uint8_t PORTA, DDRA, PINA;
+volatile uint8_t PORTB, DDRB, PINB;
+volatile uint8_t PORTC, DDRC, PINC = 0xff;
+volatile uint8_t PORTD, DDRD, PIND;
+
+volatile uint8_t ADCSRA, ADMUX;
+volatile uint16_t ADC;
+
+volatile uint8_t TCCR0A, TIMSK0, TIFR0, TCNT0, OCR0A, OCR0B;
+volatile uint8_t TCCR1A, TCCR1B, TCNT1L, TIMSK1, TIFR1;
+volatile uint16_t ICR1, OCR1A, OCR1B, TCNT1;
+volatile uint8_t ACSR, ADCSRB;
+
+volatile uint8_t SPCR, SPDR;
+volatile uint8_t PRR, SMCR, MCUSR, WDTCSR, SREG;
+volatile uint32_t host_wdt_ticks;
+volatile uint8_t PCICR, PCMSK1, PCMSK3;
+
+volatile uint8_t TWSR, TWDR, TWBR;
+HostTWCR TWCR;
+
+volatile uint32_t host_time_us;
+void (*host_delay_hook)(uint32_t us);
+
+void host_delay(uint32_t us)
+{
+	if (host_delay_hook)
+		host_delay_hook(us);
+	else
+		host_time_us += us;
+}
+
+/*
+ * Simulated I2C EEPROM
+ */
+
+#define EEPROM_I2C_ADDR 0x50
+#define EEPROM_PAGE_SIZE 32
+#define EEPROM_WRITE_TIME_US 5000
+
+/*
+ * SCL = F_CPU / (16 + 2 * TWBR) (prescaler 1), a byte plus ACK takes nine
+ * SCL periods
+ */
+#define TWI_BYTE_TIME_US (9UL * (16 + 2 * TWBR) * 1000000UL / F_CPU)
+
+/*
+ * Above this SCL frequency, every byte the EEPROM sends or receives has a
+ * flipped bit (like with weak pull-ups)
+ */
+uint32_t host_twi_max_hz = 400000;
+#define TWI_TOO_FAST (F_CPU / (16 + 2 * TWBR) > host_twi_max_hz)
+#define TWI_GARBLE (TWI_TOO_FAST ? 0x04 : 0x00)
+
+uint8_t host_eeprom[HOST_EEPROM_SIZE];
+uint32_t host_eeprom_writes;
+uint32_t host_eeprom_bytes;
+uint32_t host_eeprom_last_write;
+
+static struct EEPROMInit {
+	EEPROMInit() {
+		for (uint32_t i = 0; i < HOST_EEPROM_SIZE; i++)
+			host_eeprom[i] = 0xff;
+	}
+} eeprom_init;
+
+static enum {
+	TWI_IDLE,
+	TWI_STARTED,
+	TWI_ADDR_HI,
+	TWI_ADDR_LO,
+	TWI_WRITE,
+	TWI_READ,
+} twi_state;
+
+static uint16_t eeprom_addr;
+static uint8_t eeprom_written;
+static uint32_t eeprom_busy_until;
+static bool twi_busy;
+static uint32_t twi_done;
+
+bool host_twi_poll(void)
+{
+	if (!twi_busy || (int32_t)(host_time_us - twi_done) < 0)
+		return false;
+	twi_busy = false;
+	TWCR.value |= _BV(TWINT);
+	return true;
+}
+
+HostTWCR::operator uint8_t()
+{
+	if (twi_busy && !host_twi_poll()) {
+		host_delay(1);
+		host_twi_poll();
+	}
+	return value;
+}
+
+/*
+ * The bus operation is carried out right away, only TWINT is delayed until
+ * the operation would be complete. The firmware does not touch TWSR and
+ * TWDR before TWINT is set.
+ */
+HostTWCR &HostTWCR::operator=(uint8_t v)
+{
+	// writing a one clears TWINT
+	value = v & ~_BV(TWINT);
+
+	if (!(v & _BV(TWINT)) || !(v & _BV(TWEN)))
+		return *this;
+
+	if (v & _BV(TWSTO)) {
+		if (eeprom_written) {
+			host_eeprom_writes++;
+			host_eeprom_last_write = host_time_us;
+			eeprom_busy_until = host_time_us + EEPROM_WRITE_TIME_US;
+		}
+		eeprom_written = 0;
+		twi_state = TWI_IDLE;
+		value &= ~_BV(TWSTO);
+		// STO and STA: stop condition followed by a start condition
+		if (!(v & _BV(TWSTA)))
+			return *this;
+	}
+
+	twi_busy = true;
+	twi_done = host_time_us + TWI_BYTE_TIME_US;
+
+	if (v & _BV(TWSTA)) {
+		TWSR = (twi_state == TWI_IDLE) ? 0x08 : 0x10;
+		twi_state = TWI_STARTED;
+	} else if (twi_state == TWI_STARTED) {
+		// SLA+R/W. A busy EEPROM does not acknowledge its address.
+		if (((TWDR >> 1) != EEPROM_I2C_ADDR) || (host_time_us < eeprom_busy_until)) {
+			TWSR = (TWDR & 1) ? 0x48 : 0x20;
+			twi_state = TWI_IDLE;
+		} else if (TWDR & 1) {
+			TWSR = 0x40;
+			twi_state = TWI_READ;
+		} else {
+			TWSR = 0x18;
+			twi_state = TWI_ADDR_HI;
+		}
+	} else if (twi_state == TWI_ADDR_HI) {
+		eeprom_addr = (TWDR << 8) % HOST_EEPROM_SIZE;
+		TWSR = 0x28;
+		twi_state = TWI_ADDR_LO;
+	} else if (twi_state == TWI_ADDR_LO) {
+		eeprom_addr |= TWDR;
+		TWSR = 0x28;
+		twi_state = TWI_WRITE;
+	} else if (twi_state == TWI_WRITE) {
+		// writes wrap around within the current page
+		host_eeprom[eeprom_addr] = TWDR ^ TWI_GARBLE;
+		eeprom_addr = (eeprom_addr & ~(EEPROM_PAGE_SIZE - 1))
+			| ((eeprom_addr + 1) & (EEPROM_PAGE_SIZE - 1));
+		eeprom_written = 1;
+		host_eeprom_bytes++;
+		TWSR = 0x28;
+	} else if (twi_state == TWI_READ) {
+		// reads wrap around at the end of the memory
+		TWDR = host_eeprom[eeprom_addr] ^ TWI_GARBLE;
+		eeprom_addr = (eeprom_addr + 1) % HOST_EEPROM_SIZE;
+		TWSR = (v & _BV(TWEA)) ? 0x50 : 0x58;
+	}
+
+	return *this;
+}
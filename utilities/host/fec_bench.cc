@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2016 by Birte Kristina Friesel
+ *
+ * License: You may use, redistribute and/or modify this file under the terms
+ * of either:
+ * * The GNU LGPL v3 (see COPYING and COPYING.LESSER), or
+ * * The 3-clause BSD License (see COPYING.BSD)
+ *
+ */
+
+/*
+ * Host-side FEC test bench. Reads a raw modem byte stream (as written by
+ * blinkenrocket.py's saveModemData()), injects random bit errors and feeds
+ * it through FECModem. Reports the residual byte errors compared to an
+ * error-free decode and the host CPU time spent in FECModem per 32 decoded
+ * data bytes.
+ *
+ * -b replaces a run of consecutive raw bytes at a random position with
+ * random bytes in every round (an isolated burst error), -d drops one raw
+ * byte at a random position in every round (a byte slip at the Modem
+ * layer). The number of rounds in which FECModem re-synchronized on a frame
+ * marker is reported as resyncs. The Reed-Solomon variant drops the first
+ * uncorrectable block and the rest of the transmission instead, their bytes
+ * are reported separately and are not residual errors.
+ *
+ * Build with -DFEC_RS for the Reed-Solomon variant, see Makefile.
+ *
+ * Usage: fec_bench [-p byte error probability] [-b burst length] [-d] [-n rounds] [-s seed] <file.bin>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "fecmodem.h"
+
+// marks the bytes of a dropped block in the decoded stream
+#define DROPPED 0x100
+
+class BenchModem : public FECModem {
+	public:
+		void put(uint8_t c) { buffer_put(c); };
+};
+
+static bool run(const std::vector<uint8_t> &raw, std::vector<uint16_t> &decoded)
+{
+	BenchModem bench;
+	bool resync = false, available;
+
+	bench.enable();
+	bench.buffer_clear();
+	for (size_t i = 0; i < raw.size(); i++) {
+		bench.put(raw[i]);
+		do {
+			// decodes the next triple or block, if any
+			available = bench.buffer_available();
+			if (bench.resynchronized()) {
+				resync = true;
+#ifdef FEC_RS
+				decoded.insert(decoded.end(), RS_DATA_LEN, DROPPED);
+#endif
+			}
+			if (available)
+				decoded.push_back(bench.buffer_get());
+		} while (available);
+	}
+	return resync;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<uint8_t> raw;
+	std::vector<uint16_t> clean, decoded;
+	double probability = 0;
+	unsigned int rounds = 1000, seed = 1, burst = 0, resyncs = 0;
+	bool drop = false;
+	size_t bytes = 0, byte_errors = 0, dropped = 0, injected = 0, pos;
+	clock_t elapsed = 0, start;
+	FILE *f;
+	int c, opt;
+
+	while ((opt = getopt(argc, argv, "p:b:dn:s:")) != -1) {
+		switch (opt) {
+			case 'p':
+				probability = atof(optarg);
+				break;
+			case 'b':
+				burst = atoi(optarg);
+				break;
+			case 'd':
+				drop = true;
+				break;
+			case 'n':
+				rounds = atoi(optarg);
+				break;
+			case 's':
+				seed = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-p probability] [-b burst] [-d] [-n rounds] [-s seed] <file.bin>\n", argv[0]);
+				return 2;
+		}
+	}
+	if (optind >= argc || !rounds) {
+		fprintf(stderr, "Usage: %s [-p probability] [-b burst] [-d] [-n rounds] [-s seed] <file.bin>\n", argv[0]);
+		return 2;
+	}
+
+	if ((f = fopen(argv[optind], "rb")) == NULL) {
+		perror(argv[optind]);
+		return 1;
+	}
+	while ((c = fgetc(f)) != EOF)
+		raw.push_back(c);
+	fclose(f);
+
+	run(raw, clean);
+	srand(seed);
+
+	for (unsigned int round = 0; round < rounds; round++) {
+		std::vector<uint8_t> noisy(raw);
+
+		for (size_t i = 0; i < noisy.size(); i++) {
+			if (rand() < probability * RAND_MAX) {
+				noisy[i] ^= 1 << (rand() % 8);
+				injected++;
+			}
+		}
+		if (burst && (burst < noisy.size())) {
+			pos = rand() % (noisy.size() - burst);
+			for (size_t i = pos; i < pos + burst; i++)
+				noisy[i] = rand();
+			injected += burst;
+		}
+		if (drop) {
+			noisy.erase(noisy.begin() + rand() % noisy.size());
+			injected++;
+		}
+
+		decoded.clear();
+		start = clock();
+		if (run(noisy, decoded)) {
+			resyncs++;
+#ifdef FEC_RS
+			// the rest of the transmission is dropped along with the block
+			if (decoded.size() < clean.size())
+				decoded.resize(clean.size(), DROPPED);
+#endif
+		}
+		elapsed += clock() - start;
+
+		for (size_t i = 0; i < clean.size(); i++) {
+			if ((i < decoded.size()) && (decoded[i] == DROPPED))
+				dropped++;
+			else if (i >= decoded.size() || decoded[i] != clean[i])
+				byte_errors++;
+		}
+		bytes += clean.size();
+	}
+
+#ifdef FEC_RS
+	printf("FEC:                Reed-Solomon RS(%d, %d)\n", RS_BLOCK_LEN, RS_DATA_LEN);
+#ifdef FEC_RS_TABLES
+	printf("lookup tables:      %u bytes\n", (unsigned int)(sizeof(gfExp) + sizeof(gfLog)));
+#else
+	printf("lookup tables:      none\n");
+#endif
+#else
+	printf("FEC:                Hamming 2416\n");
+	printf("lookup tables:      %u bytes\n", (unsigned int)(sizeof(hammingParityLow)
+			+ sizeof(hammingParityHigh) + sizeof(hammingParityCheck)));
+#endif
+	printf("raw / data bytes:   %zu / %zu (%.1f%% overhead)\n", raw.size(), clean.size(),
+			100.0 * raw.size() / clean.size() - 100);
+	printf("injected errors:    %zu in %u rounds\n", injected, rounds);
+	printf("residual errors:    %zu of %zu bytes\n", byte_errors, bytes);
+#ifdef FEC_RS
+	printf("dropped blocks:     %zu (%zu bytes) in %u rounds\n", dropped / RS_DATA_LEN, dropped, resyncs);
+#else
+	printf("resyncs:            %u of %u rounds\n", resyncs, rounds);
+#endif
+	printf("host time:          %.1f ns per 32 data bytes\n",
+			1e9 * elapsed / CLOCKS_PER_SEC / bytes * 32);
+
+	return 0;
+}
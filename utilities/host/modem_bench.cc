@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2016 by Birte Kristina Friesel
+ *
+ * License: You may use, redistribute and/or modify this file under the terms
+ * of either:
+ * * The GNU LGPL v3 (see COPYING and COPYING.LESSER), or
+ * * The 3-clause BSD License (see COPYING.BSD)
+ *
+ */
+
+/*
+ * Host-side modem test bench. Resamples a WAV file (as written by
+ * blinkenrocket.py) to the ADC sample rate, feeds it through
+ * Modem::receiveADC() and compares the received raw byte stream against a
+ * reference file (as written by blinkenrocket.py's saveModemData()).
+ *
+ * -s simulates a main loop which only reads the receive buffer every <stall>
+ * milliseconds (e.g. because of EEPROM writes), -x lends it additional
+ * memory (Modem::buffer_expand) like System does during a transmission.
+ *
+ * Built with -DMODEM_COMPARATOR (modem_bench_cmp), the analog comparator
+ * and Timer1 input capture are simulated on the original samples instead.
+ * -t sets the comparator threshold relative to the signal's center (full
+ * scale = 1) to simulate a mismatch between input bias and bandgap.
+ *
+ * Usage: modem_bench [-g gain] [-s stall] [-t threshold] [-x] <file.wav> [reference.bin]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include <avr/io.h>
+
+#include "fecmodem.h"
+#include "wav.h"
+
+#ifdef MODEM_COMPARATOR
+extern "C" void TIMER1_CAPT_vect(void);
+extern "C" void TIMER1_COMPA_vect(void);
+
+/*
+ * Comparator output for a sample: AIN+ (bandgap) > AIN- (signal)
+ */
+static bool comparator(float sample, float gain, float threshold)
+{
+	return sample * gain < threshold;
+}
+#else
+extern "C" void ADC_vect(void);
+#endif
+
+static uint8_t popcount(uint8_t byte)
+{
+	uint8_t ret = 0;
+	for (; byte; byte >>= 1)
+		ret += byte & 1;
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<float> samples;
+	std::vector<uint16_t> adc;
+	std::vector<uint8_t> received, reference;
+	uint32_t rate = 0;
+	float gain = 1.0;
+#ifdef MODEM_COMPARATOR
+	float threshold = 0;
+#endif
+	uint32_t stall = 0, sample = 0, interrupts = 0;
+	uint8_t ext[MODEM_BUFFER_SIZE];
+	bool expand = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "g:s:t:x")) != -1) {
+		switch (opt) {
+			case 'g':
+				gain = atof(optarg);
+				break;
+			case 's':
+				stall = atoi(optarg) * MODEM_SAMPLE_RATE / 1000;
+				break;
+#ifdef MODEM_COMPARATOR
+			case 't':
+				threshold = atof(optarg);
+				break;
+#endif
+			case 'x':
+				expand = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-g gain] [-s stall] [-t threshold] [-x] <file.wav> [reference.bin]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: %s [-g gain] [-s stall] [-t threshold] [-x] <file.wav> [reference.bin]\n", argv[0]);
+		return 2;
+	}
+
+	if (!read_wav(argv[optind], samples, rate))
+		return 1;
+
+	if (optind + 1 < argc) {
+		FILE *f = fopen(argv[optind + 1], "rb");
+		int c;
+		if (f == NULL) {
+			perror(argv[optind + 1]);
+			return 1;
+		}
+		while ((c = fgetc(f)) != EOF)
+			reference.push_back(c);
+		fclose(f);
+	}
+
+	modem.enable();
+	if (expand)
+		modem.buffer_expand(ext);
+
+	wav_to_adc(samples, rate, gain, adc);
+
+#ifdef MODEM_COMPARATOR
+	/*
+	 * Timer1 ticks per WAV sample. Zero crossings between two WAV samples
+	 * are linearly interpolated. The main loop still runs at the ADC rate.
+	 */
+	double ticks = F_CPU / 8.0 / rate;
+	uint16_t timer = 0, prev_timer;
+	size_t wav = 1;
+#endif
+
+	for (size_t i = 0; i < adc.size(); i++) {
+#ifdef MODEM_COMPARATOR
+		for (; wav < samples.size() && wav < (i + 1) * (double)rate / MODEM_SAMPLE_RATE; wav++) {
+			bool prev = comparator(samples[wav - 1], gain, threshold);
+			bool cur = comparator(samples[wav], gain, threshold);
+			if (prev == cur)
+				continue;
+			float a = samples[wav - 1] * gain - threshold;
+			float b = samples[wav] * gain - threshold;
+			// ICES1 set: capture rising edges of the comparator output
+			if (cur == !!(TCCR1B & _BV(ICES1))) {
+				ICR1 = (uint32_t)((wav - 1 + a / (a - b)) * ticks);
+				TIMER1_CAPT_vect();
+				interrupts++;
+			}
+		}
+		prev_timer = timer;
+		timer = (uint32_t)(wav * ticks);
+		if ((TIMSK1 & _BV(OCIE1A)) && (uint16_t)(OCR1A - prev_timer - 1) < (uint16_t)(timer - prev_timer)) {
+			TIMER1_COMPA_vect();
+			interrupts++;
+		}
+#else
+		ADC = adc[i];
+		ADC_vect();
+		interrupts++;
+#endif
+
+		if (stall && (++sample % stall))
+			continue;
+		modem.newTransmission();
+		while (modem.Modem::buffer_available())
+			received.push_back(modem.Modem::buffer_get());
+	}
+	modem.newTransmission();
+	while (modem.Modem::buffer_available())
+		received.push_back(modem.Modem::buffer_get());
+
+	printf("received %zu bytes, %u overflows\n", received.size(), modem.buffer_overflow_count());
+	printf("%u interrupts (%.0f per second)\n", interrupts,
+			(double)interrupts * MODEM_SAMPLE_RATE / adc.size());
+
+	if (reference.size()) {
+		size_t bit_errors = 0;
+		size_t byte_errors = 0;
+		for (size_t i = 0; i < reference.size(); i++) {
+			if (i >= received.size()) {
+				bit_errors += 8;
+				byte_errors++;
+			} else if (received[i] != reference[i]) {
+				bit_errors += popcount(received[i] ^ reference[i]);
+				byte_errors++;
+			}
+		}
+		printf("reference %zu bytes, %zu byte errors, %zu bit errors, BER %.6f\n",
+				reference.size(), byte_errors, bit_errors,
+				(double)bit_errors / (reference.size() * 8));
+		return bit_errors ? 1 : 0;
+	}
+
+	for (size_t i = 0; i < received.size(); i++)
+		printf("%02x%c", received[i], (i % 16 == 15) ? '\n' : ' ');
+	printf("\n");
+
+	return 0;
+}
@@ -0,0 +1,119 @@
+#!/usr/bin/env python
+#
+# Robustness sweep. Generates a test transmission with blinkenrocket.py,
+# applies impairments (noise, volume, clipping, sample rate drift) and runs
+# each variant through modem_bench (raw bit error rate) and system_bench
+# (FEC statistics, patterns stored in the simulated EEPROM). With
+# "comparator", the raw bit error rate is measured with modem_bench_cmp
+# (analog comparator front end) instead, with "24c512" the patterns are
+# stored by system_bench_24c512 (64 KiB EEPROM).
+# Usage: modem_sweep.py [frequency] [rs] [fast|quad] [carousel] [comparator] [24c512]
+
+import os
+import random
+import re
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import wave
+
+here = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(here, '..'))
+from blinkenrocket import *
+
+# (label, volume, noise, drive, drift)
+# noise: standard deviation of white gaussian noise (1.0 = full scale)
+# drive: overdrive factor before clipping at full scale
+# drift: relative playback sample rate error
+impairments = [('clean', 1.0, 0, 1, 0)]
+impairments += [('noise %.3f' % n, 1.0, n, 1, 0) for n in (0.005, 0.01, 0.02, 0.05)]
+impairments += [('volume %.2f' % v, v, 0, 1, 0) for v in (0.3, 0.1, 0.03, 0.01)]
+impairments += [('vol 0.1 noise %.2f' % n, 0.1, n, 1, 0) for n in (0.01, 0.02, 0.05)]
+impairments += [('clip x%d' % d, 1.0, 0, d, 0) for d in (2, 5, 20)]
+impairments += [('drift %+.1f%%' % (100 * d), 1.0, 0, 1, d) for d in (-0.03, -0.01, 0.01, 0.03)]
+
+def impair(samples, volume, noise, drive, drift):
+	# resample so that the recording plays (1 + drift) times as fast
+	if drift:
+		resampled = []
+		t = 0.0
+		while t + 1 < len(samples):
+			i = int(t)
+			resampled.append(samples[i] * (1 - t + i) + samples[i + 1] * (t - i))
+			t += 1 + drift
+		samples = resampled
+	output = []
+	for x in samples:
+		x = max(-1.0, min(1.0, x * drive)) * volume + random.gauss(0, noise)
+		output.append(max(-32768, min(32767, int(round(x * 32767)))))
+	return output
+
+def saveWav(filename, frequency, samples):
+	wav = wave.open(filename, 'wb')
+	wav.setparams((1, 2, frequency, 0, "NONE", None))
+	wav.writeframes(struct.pack('<%dh' % len(samples), *samples))
+	wav.close()
+
+def run(args):
+	output = subprocess.Popen(args, stdout=subprocess.PIPE).communicate()[0]
+	values = {}
+	for line in output.splitlines():
+		match = re.match(r'([^:]+):\s+(.*)', line)
+		if match:
+			values[match.group(1)] = match.group(2)
+		match = re.match(r'reference .*, BER ([0-9.]+)', line)
+		if match:
+			values['BER'] = match.group(1)
+	return values
+
+if __name__ == '__main__':
+	options = sys.argv[1:]
+	frequency = int(options[0]) if options and options[0].isdigit() else 48000
+	rs = 'rs' in options
+	if rs and 'carousel' in options:
+		raise RuntimeError("Carousel mode requires the Hamming code")
+	m = modem(parity=True, frequency=frequency, reedsolomon=rs)
+	if 'fast' in options:
+		m.setProfile(modem.PROFILE_FAST)
+	elif 'quad' in options:
+		m.setProfile(modem.PROFILE_QUAD)
+	b = blinkenrocket()
+	b.addFrame(textFrame(" Blinkenrocket Test Scroller  !!! "))
+	b.addFrame(animationFrame(map(lambda x : chr(x), range(64)), speed=10))
+	m.setData(b.getCarousel() if 'carousel' in options else b.getMessage())
+
+	# EEPROM image: directory in bytes 0 .. 255 (layout version 1),
+	# patterns after it
+	directory, data = b.getStorageImage()
+	image = directory + [chr(0xff)] * (-len(directory) % 256) + data
+
+	samples = [(ord(c) - 128) / 128.0 for c in m.generateAudioFrames()]
+	random.seed(1)
+
+	tmp = tempfile.mkdtemp()
+	try:
+		with open(os.path.join(tmp, 'ref.bin'), 'wb') as f:
+			f.write("".join(m.generateModemData()))
+		with open(os.path.join(tmp, 'ref.img'), 'wb') as f:
+			f.write("".join(image))
+
+		print '%-20s %10s %9s %9s %9s %11s' % ('impairment', 'BER', 'corrected',
+			'uncorr.', 'timeouts', 'EEPROM ok')
+		for label, volume, noise, drive, drift in impairments:
+			wav = os.path.join(tmp, 'sweep.wav')
+			saveWav(wav, frequency, impair(samples, volume, noise, drive, drift))
+			bench = run([os.path.join(here, 'modem_bench_cmp' if 'comparator' in options else 'modem_bench'),
+				wav, os.path.join(tmp, 'ref.bin')])
+			system = run([os.path.join(here, 'system_bench_rs' if rs
+				else 'system_bench_24c512' if '24c512' in options else 'system_bench'),
+				wav, os.path.join(tmp, 'ref.img')])
+			match = re.match(r'(\d+) bytes, (\d+) byte errors', system.get('reference', ''))
+			print '%-20s %10s %9s %9s %9s %11s' % (label, bench.get('BER', '-'),
+				system.get('FEC corrected', '-'), system.get('FEC uncorrectable', '-'),
+				system.get('timeouts', '-'),
+				'%s/%s' % (int(match.group(1)) - int(match.group(2)), match.group(1))
+					if match else 'invalid')
+	finally:
+		shutil.rmtree(tmp)
@@ -0,0 +1,46 @@
+#!/usr/bin/env python
+#
+# Writes a modem test transmission (WAV) and the byte stream it encodes.
+# With "edit", the transmission edits the test patterns instead (replaces
+# the first one, appends one, deletes the second one and sets the brightness
+# to 2/8), and the storage image of the resulting patterns is written to
+# <out>.img. With "carousel", it is a carousel transmission of two different
+# patterns, whose storage image is written to <out>.img as well.
+# Usage: modem_testsignal.py <out.wav> <out.bin> [frequency] [rs] [fast|quad] [edit|carousel]
+
+import os
+import sys
+sys.path.insert(0, '..')
+from blinkenrocket import *
+
+if __name__ == '__main__':
+	options = sys.argv[4:]
+	if 'rs' in options and 'carousel' in options:
+		raise RuntimeError("Carousel mode requires the Hamming code")
+	m = modem(parity=True, frequency=int(sys.argv[3]) if len(sys.argv) > 3 else 48000,
+		reedsolomon='rs' in options)
+	if 'fast' in options:
+		m.setProfile(modem.PROFILE_FAST)
+	elif 'quad' in options:
+		m.setProfile(modem.PROFILE_QUAD)
+	b = blinkenrocket()
+	b.addFrame(textFrame(" Blinkenrocket Test Scroller  !!! "))
+	b.addFrame(animationFrame(map(lambda x : chr(x), range(64)), speed=10))
+	if 'edit' in options:
+		edited = textFrame("Edited")
+		appended = textFrame("Appended pattern")
+		m.setData(b.getEditMessage([('replace', 0, edited), ('append', appended), ('delete', 1),
+			('brightness', 2)]))
+		b.frames = [edited, appended]
+	elif 'carousel' in options:
+		b.frames = [textFrame("Carousel"), animationFrame(map(chr, range(255, 191, -1)), speed=10)]
+		m.setData(b.getCarousel())
+	else:
+		m.setData(b.getMessage())
+	if 'edit' in options or 'carousel' in options:
+		directory, data = b.getStorageImage()
+		image = open(os.path.splitext(sys.argv[2])[0] + '.img', 'wb')
+		image.write(''.join(directory + [chr(0xff)] * (-len(directory) % 256) + data))
+		image.close()
+	m.saveAudio(sys.argv[1])
+	m.saveModemData(sys.argv[2])
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2016 by Birte Kristina Friesel
+ *
+ * License: You may use, redistribute and/or modify this file under the terms
+ * of either:
+ * * The GNU LGPL v3 (see COPYING and COPYING.LESSER), or
+ * * The 3-clause BSD License (see COPYING.BSD)
+ *
+ */
+
+/*
+ * Reads the patterns from an EEPROM image the way the firmware does: loads
+ * the image into the simulated EEPROM, mounts it with Storage::enable() and
+ * reads every pattern with Storage::load() and Storage::loadChunk(). Prints
+ * one line per pattern: its index, "ok" or "corrupt" (Storage::verify()) and
+ * its header and data bytes in hex. Used by eeprom_image.py --check.
+ *
+ * Build with -DSTORAGE_SIZE=... for EEPROMs larger than 8 KiB, see Makefile.
+ *
+ * Usage: storage_dump <image.bin>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <avr/io.h>
+
+#include "storage.h"
+
+int main(int argc, char **argv)
+{
+	static uint8_t pattern[4 + 4096 + 64];
+	uint16_t length;
+	uint32_t size = 0;
+	FILE *f;
+	int c;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <image.bin>\n", argv[0]);
+		return 2;
+	}
+
+	if ((f = fopen(argv[1], "rb")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	while ((c = fgetc(f)) != EOF) {
+		if (size == HOST_EEPROM_SIZE) {
+			fprintf(stderr, "%s: larger than the EEPROM (%u bytes)\n",
+					argv[1], (unsigned int)HOST_EEPROM_SIZE);
+			return 1;
+		}
+		host_eeprom[size++] = c;
+	}
+	fclose(f);
+
+	storage.enable();
+
+	for (uint8_t i = 0; storage.hasData() && i < storage.numPatterns(); i++) {
+		printf("%u %s ", i, storage.verify(i) ? "ok" : "corrupt");
+
+		// the first 128 data bytes come with load(), then 64 byte chunks
+		storage.load(i, pattern);
+		length = ((pattern[0] & 0x0f) << 8) | pattern[1];
+		for (uint8_t chunk = 2; chunk * 64 < length; chunk++) {
+			storage.loadChunk(chunk, pattern + 4 + (chunk * 64));
+			storage.waitChunk();
+		}
+
+		for (uint16_t j = 0; j < length + 4; j++)
+			printf("%02x", pattern[j]);
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2016 by Birte Kristina Friesel
+ *
+ * License: You may use, redistribute and/or modify this file under the terms
+ * of either:
+ * * The GNU LGPL v3 (see COPYING and COPYING.LESSER), or
+ * * The 3-clause BSD License (see COPYING.BSD)
+ *
+ */
+
+/*
+ * Host-side system test bench. Runs the complete receive path --
+ * Modem::receiveADC(), FECModem and System::receive() writing to a simulated
+ * I2C EEPROM -- on a WAV file, with the main loop running after each ADC
+ * interrupt like on the rocket. EEPROM transfers and busy waits take
+ * simulated time during which ADC (and watchdog) interrupts keep coming in.
+ *
+ * Reports the FEC statistics, watchdog timeouts, the I2C clock, the number
+ * of patterns which fail their CRC check and the net throughput (pattern
+ * bytes written per second between the start of the transmission and the
+ * last EEPROM write). If a reference EEPROM image is given (as
+ * written by modem_sweep.py), the number of differing bytes is reported as
+ * well. -v dumps all non-empty EEPROM pages.
+ *
+ * -i loads the initial EEPROM contents from a file (e.g. one written by
+ * -o after a previous run), -c cuts the recording off after <ms>
+ * milliseconds like an interrupted transmission. -s sets the highest I2C
+ * clock the simulated EEPROM works with, the firmware must fall back to a
+ * slower one. -f flips all bits of the EEPROM byte at addr before the run,
+ * the firmware must then report (exactly) one corrupt pattern.
+ *
+ * Usage: system_bench [-c ms] [-f addr] [-g gain] [-i initial.img] [-o final.img] [-s kHz] [-v] <file.wav> [reference.img]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include <avr/io.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+#include "display.h"
+#include "system.h"
+#include "storage.h"
+#include "fecmodem.h"
+#include "wav.h"
+
+extern "C" void ADC_vect(void);
+extern "C" void WDT_vect(void);
+extern "C" void TWI_vect(void);
+
+// WDP3: 4 seconds
+#define WDT_TIMEOUT_TICKS (4UL * MODEM_SAMPLE_RATE)
+
+// silence appended to the recording so that pending timeouts can expire
+#define TRAILER_TICKS (5UL * MODEM_SAMPLE_RATE)
+
+static std::vector<uint16_t> adc;
+static size_t adc_pos;
+static double sim_time;
+static uint32_t timeouts, tx_start, loop_max;
+static bool tx_started;
+
+/*
+ * Advances the simulated time by one ADC sample and runs the interrupts
+ * which occur in that time.
+ */
+static void tick(void)
+{
+	ADC = (adc_pos < adc.size()) ? adc[adc_pos] : 512;
+	adc_pos++;
+	ADC_vect();
+
+	sim_time += 1e6 / MODEM_SAMPLE_RATE;
+	host_time_us = sim_time;
+	// Timer1 (Storage::poll() uses it to time EEPROM retries)
+	TCNT1 = (uint32_t)(sim_time * MODEM_TIMER1_HZ / 1e6);
+
+	// TWINT is level triggered, like on the real hardware
+	host_twi_poll();
+	if ((TWCR.value & _BV(TWINT)) && (TWCR.value & _BV(TWIE))
+			&& (SREG & _BV(SREG_I)))
+		TWI_vect();
+
+	if (WDTCSR & _BV(WDIE)) {
+		if (!tx_started) {
+			tx_started = true;
+			tx_start = host_time_us;
+		}
+		if (++host_wdt_ticks >= WDT_TIMEOUT_TICKS) {
+			timeouts++;
+			WDT_vect();
+		}
+	}
+}
+
+static void delay_hook(uint32_t us)
+{
+	double end = sim_time + us;
+
+	while (sim_time < end)
+		tick();
+}
+
+/*
+ * Offset of directory entry idx inside a storage layout version 3 slot
+ */
+static uint16_t entry_offset(uint8_t idx)
+{
+	return 4 + (idx * 4) + ((idx >= 62) ? 4 : 0);
+}
+
+/*
+ * Checks a storage layout version 3 directory slot, see Storage::checkSlot()
+ */
+static bool slot_valid(const uint8_t *slot)
+{
+	uint16_t crc = 0xffff;
+
+	if ((slot[255] != STORAGE_LAYOUT_V3) || (slot[0] > STORAGE_V3_ANIMS))
+		return false;
+	for (uint8_t i = 0; i < slot[0]; i++)
+		for (uint8_t j = 0; j < 4; j++)
+			crc = _crc16_update(crc, slot[entry_offset(i) + j]);
+	// log head
+	crc = _crc16_update(crc, slot[506]);
+	crc = _crc16_update(crc, slot[507]);
+	crc = _crc16_update(crc, slot[0]);
+	crc = _crc16_update(crc, slot[254]);
+	return (slot[510] | (slot[511] << 8)) == crc;
+}
+
+/*
+ * Offset of the directory in an EEPROM image (storage layout version 1
+ * or 3, see storage.cc), -1 if there are no patterns
+ */
+static int32_t directory(const uint8_t *image)
+{
+	int32_t dir = 0;
+
+	if (image[255] == STORAGE_LAYOUT_V3) {
+		bool a = slot_valid(image), b = slot_valid(image + 512);
+		if (b && (!a || (int8_t)(image[512 + 254] - image[254]) > 0))
+			dir = 512;
+		else if (!a)
+			return -1;
+	}
+	return (image[dir] == 0xff) ? -1 : dir;
+}
+
+/*
+ * Start address of pattern idx in an EEPROM image with directory offset dir
+ */
+static uint32_t pattern_addr(const uint8_t *image, int32_t dir, uint8_t idx)
+{
+	if (image[255] == STORAGE_LAYOUT_V3)
+		return 1024 + 32 * (image[dir + entry_offset(idx)] | (image[dir + entry_offset(idx) + 1] << 8));
+	return 256 + 32 * image[1 + idx];
+}
+
+/*
+ * Compares the patterns on the EEPROM against a reference image (directory
+ * in bytes 0 .. 255 or 1023, patterns after it, see Storage). Storage
+ * writes whole pages and may use a different layout version than the
+ * reference, so only the number of patterns and the pattern bytes covered
+ * by the pattern headers are compared.
+ */
+static bool compare(const std::vector<uint8_t> &ref, size_t &bytes, size_t &byte_errors)
+{
+	uint32_t addr, ref_addr;
+	int32_t dir, ref_dir;
+	uint16_t len;
+	uint8_t count;
+
+	if ((ref.size() < 256)
+			|| ((ref[255] == STORAGE_LAYOUT_V3) && (ref.size() < 1024))
+			|| ((ref_dir = directory(&ref[0])) < 0))
+		return false;
+	dir = directory(host_eeprom);
+
+	count = (dir < 0) ? 0 : host_eeprom[dir];
+
+	bytes++;
+	if (count != ref[ref_dir])
+		byte_errors++;
+
+	// patterns missing on the EEPROM count as errors
+	for (uint8_t i = 0; i < ref[ref_dir]; i++) {
+		ref_addr = pattern_addr(&ref[0], ref_dir, i);
+		if (ref_addr + 4 > ref.size())
+			return false;
+		len = 4 + (((ref[ref_addr] & 0x0f) << 8) | ref[ref_addr + 1]);
+		addr = (i < count) ? pattern_addr(host_eeprom, dir, i) : 0;
+		for (uint16_t j = 0; j < len && ref_addr + j < ref.size(); j++, bytes++)
+			if ((i >= count) || host_eeprom[(addr + j) % HOST_EEPROM_SIZE] != ref[ref_addr + j])
+				byte_errors++;
+	}
+	return true;
+}
+
+static bool read_file(const char *filename, std::vector<uint8_t> &data)
+{
+	FILE *f = fopen(filename, "rb");
+	int c;
+
+	if (f == NULL) {
+		perror(filename);
+		return false;
+	}
+	while ((c = fgetc(f)) != EOF && data.size() < HOST_EEPROM_SIZE)
+		data.push_back(c);
+	fclose(f);
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<float> samples;
+	std::vector<uint8_t> reference, initial;
+	const char *final_image = NULL;
+	uint32_t rate = 0, cut = 0;
+	int32_t flip = -1;
+	uint8_t corrupt = 0;
+	float gain = 1.0;
+	bool verbose = false;
+	int32_t dir;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:f:g:i:o:s:v")) != -1) {
+		switch (opt) {
+			case 'c':
+				cut = atoi(optarg) * MODEM_SAMPLE_RATE / 1000;
+				break;
+			case 'f':
+				flip = strtol(optarg, NULL, 0) % HOST_EEPROM_SIZE;
+				break;
+			case 'g':
+				gain = atof(optarg);
+				break;
+			case 'i':
+				if (!read_file(optarg, initial))
+					return 1;
+				break;
+			case 'o':
+				final_image = optarg;
+				break;
+			case 's':
+				host_twi_max_hz = atoi(optarg) * 1000;
+				break;
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-c ms] [-f addr] [-g gain] [-i initial.img] [-o final.img] [-s kHz] [-v] <file.wav> [reference.img]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Usage: %s [-c ms] [-f addr] [-g gain] [-i initial.img] [-o final.img] [-s kHz] [-v] <file.wav> [reference.img]\n", argv[0]);
+		return 2;
+	}
+
+	if (!read_wav(argv[optind], samples, rate))
+		return 1;
+
+	if (optind + 1 < argc && !read_file(argv[optind + 1], reference))
+		return 1;
+
+	wav_to_adc(samples, rate, gain, adc);
+	if (cut && cut < adc.size())
+		adc.resize(cut);
+
+	for (size_t i = 0; i < initial.size(); i++)
+		host_eeprom[i] = initial[i];
+	if (flip >= 0)
+		host_eeprom[flip] ^= 0xff;
+
+	host_delay_hook = delay_hook;
+	rocket.initialize();
+
+	while (adc_pos < adc.size()
+			|| ((WDTCSR & _BV(WDIE)) && adc_pos < adc.size() + TRAILER_TICKS)) {
+		uint32_t loop_start;
+
+		tick();
+		loop_start = host_time_us;
+		rocket.loop();
+		// during a transmission (END loads the first pattern, which is slow)
+		if (modem.buffer_expanded() && host_time_us - loop_start > loop_max)
+			loop_max = host_time_us - loop_start;
+	}
+
+	printf("audio:              %.2f s\n", (double)adc.size() / MODEM_SAMPLE_RATE);
+	printf("modem overflows:    %u\n", modem.buffer_overflow_count());
+	printf("FEC corrected:      %u\n", modem.stats_corrected);
+	printf("FEC uncorrectable:  %u\n", modem.stats_uncorrectable);
+	printf("timeouts:           %u\n", (unsigned int)timeouts);
+	printf("longest rx loop:    %.1f ms\n", loop_max / 1000.0);
+	printf("I2C clock:          %u kHz\n", storage.busClock());
+	printf("brightness:         %u/8\n", display.getBrightness());
+	dir = directory(host_eeprom);
+	printf("patterns:           %u\n", dir < 0 ? 0 : host_eeprom[dir]);
+	for (uint8_t i = 0; storage.hasData() && i < storage.numPatterns(); i++)
+		if (!storage.verify(i))
+			corrupt++;
+	printf("corrupt patterns:   %u\n", corrupt);
+	printf("EEPROM writes:      %u (%u bytes)\n", (unsigned int)host_eeprom_writes,
+			(unsigned int)host_eeprom_bytes);
+	if (tx_started && host_eeprom_last_write > tx_start)
+		printf("throughput:         %.1f bytes/s\n",
+				1e6 * host_eeprom_bytes / (host_eeprom_last_write - tx_start));
+
+	if (verbose) {
+		for (uint32_t page = 0; page < HOST_EEPROM_SIZE; page += 32) {
+			bool empty = true;
+			for (uint8_t i = 0; i < 32; i++)
+				if (host_eeprom[page + i] != 0xff)
+					empty = false;
+			if (empty)
+				continue;
+			printf("%04x:", page);
+			for (uint8_t i = 0; i < 32; i++)
+				printf(" %02x", host_eeprom[page + i]);
+			printf("\n");
+		}
+	}
+
+	if (final_image) {
+		FILE *f = fopen(final_image, "wb");
+		if (f == NULL || fwrite(host_eeprom, 1, HOST_EEPROM_SIZE, f) != HOST_EEPROM_SIZE) {
+			perror(final_image);
+			return 1;
+		}
+		fclose(f);
+	}
+
+	if (reference.size()) {
+		size_t bytes = 0, byte_errors = 0;
+		if (compare(reference, bytes, byte_errors))
+			printf("reference:          %zu bytes, %zu byte errors\n",
+					bytes, byte_errors);
+		else
+			printf("reference:          invalid image\n");
+		if (byte_errors)
+			return 1;
+	}
+
+	return (corrupt != (flip >= 0 ? 1 : 0)) ? 1 : 0;
+}
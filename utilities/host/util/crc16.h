@@ -0,0 +1,21 @@
+/*
+ * Host stand-in for <util/crc16.h>, same algorithms as the avr-libc
+ * assembly versions.
+ */
+
+#ifndef HOST_UTIL_CRC16_H_
+#define HOST_UTIL_CRC16_H_
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+	uint8_t i;
+
+	crc ^= a;
+	for (i = 0; i < 8; i++)
+		crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+	return crc;
+}
+
+#endif /* HOST_UTIL_CRC16_H_ */
@@ -0,0 +1,21 @@
+/*
+ * Host stand-in for <util/delay.h>. Busy waits advance the simulated time,
+ * see host_delay() in <avr/io.h>.
+ */
+
+#ifndef HOST_UTIL_DELAY_H_
+#define HOST_UTIL_DELAY_H_
+
+#include <avr/io.h>
+
+static inline void _delay_ms(double ms)
+{
+	host_delay(ms * 1000);
+}
+
+static inline void _delay_us(double us)
+{
+	host_delay(us);
+}
+
+#endif /* HOST_UTIL_DELAY_H_ */
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 by Birte Kristina Friesel
+ *
+ * License: You may use, redistribute and/or modify this file under the terms
+ * of either:
+ * * The GNU LGPL v3 (see COPYING and COPYING.LESSER), or
+ * * The 3-clause BSD License (see COPYING.BSD)
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <avr/io.h>
+
+#include "modem.h"
+#include "wav.h"
+
+static uint16_t read16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+	return read16(p) | ((uint32_t)read16(p + 2) << 16);
+}
+
+bool read_wav(const char *filename, std::vector<float> &samples, uint32_t &rate)
+{
+	FILE *f = fopen(filename, "rb");
+	std::vector<uint8_t> buf;
+	uint8_t tmp[4096];
+	size_t len;
+	uint16_t channels = 0, bits = 0;
+	size_t pos = 12;
+
+	if (f == NULL) {
+		perror(filename);
+		return false;
+	}
+	while ((len = fread(tmp, 1, sizeof(tmp), f)) > 0)
+		buf.insert(buf.end(), tmp, tmp + len);
+	fclose(f);
+
+	if (buf.size() < 12 || memcmp(&buf[0], "RIFF", 4) || memcmp(&buf[8], "WAVE", 4)) {
+		fprintf(stderr, "%s: not a WAV file\n", filename);
+		return false;
+	}
+
+	while (pos + 8 <= buf.size()) {
+		uint32_t chunk_len = read32(&buf[pos + 4]);
+		const uint8_t *chunk = &buf[pos + 8];
+
+		if (!memcmp(&buf[pos], "fmt ", 4)) {
+			channels = read16(chunk + 2);
+			rate = read32(chunk + 4);
+			bits = read16(chunk + 14);
+		} else if (!memcmp(&buf[pos], "data", 4)) {
+			if (pos + 8 + chunk_len > buf.size())
+				chunk_len = buf.size() - pos - 8;
+			if (channels != 1 || (bits != 8 && bits != 16)) {
+				fprintf(stderr, "%s: only mono 8/16-bit PCM is supported\n", filename);
+				return false;
+			}
+			for (uint32_t i = 0; i < chunk_len; i += bits / 8) {
+				if (bits == 8)
+					samples.push_back((chunk[i] - 128) / 128.0f);
+				else
+					samples.push_back((int16_t)read16(chunk + i) / 32768.0f);
+			}
+			return true;
+		}
+		pos += 8 + chunk_len + (chunk_len & 1);
+	}
+
+	fprintf(stderr, "%s: no data chunk\n", filename);
+	return false;
+}
+
+void wav_to_adc(const std::vector<float> &samples, uint32_t rate, float gain,
+		std::vector<uint16_t> &adc)
+{
+	double step = (double)rate / MODEM_SAMPLE_RATE;
+
+	for (double t = 0; t + 1 < samples.size(); t += step) {
+		size_t i = (size_t)t;
+		float frac = t - i;
+		float value = samples[i] * (1 - frac) + samples[i + 1] * frac;
+		int reading = 512 + (int)(value * gain * 511);
+
+		adc.push_back(reading < 0 ? 0 : (reading > 1023 ? 1023 : reading));
+	}
+}
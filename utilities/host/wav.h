@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2016 by Birte Kristina Friesel
+ *
+ * License: You may use, redistribute and/or modify this file under the terms
+ * of either:
+ * * The GNU LGPL v3 (see COPYING and COPYING.LESSER), or
+ * * The 3-clause BSD License (see COPYING.BSD)
+ *
+ */
+
+#ifndef HOST_WAV_H_
+#define HOST_WAV_H_
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * Reads a mono 8-bit (unsigned) or 16-bit (signed) PCM WAV file and returns
+ * its samples normalized to -1 .. 1.
+ */
+bool read_wav(const char *filename, std::vector<float> &samples, uint32_t &rate);
+
+/*
+ * Resamples (linear interpolation) to the ADC rate and converts to 10-bit
+ * ADC readings centered around 512.
+ */
+void wav_to_adc(const std::vector<float> &samples, uint32_t rate, float gain,
+		std::vector<uint16_t> &adc);
+
+#endif /* HOST_WAV_H_ */
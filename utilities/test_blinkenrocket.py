@@ -50,6 +50,35 @@ class TestAnimation(unittest.TestCase):
     anim = animationFrame([],speed=7,delay=8)
     self.assertEquals(anim.getHeader(),[chr(7),chr(8)])
 
+  def test_deltaAnimation(self):
+    frames = [0x00, 0x18, 0x3c, 0x7e, 0x7e, 0x3c, 0x18, 0x00] * 2
+    frames[8+3] = 0xff
+    anim = animationFrame(map(chr, frames))
+    self.assertEquals(anim.getRepresentation()[0:2],[chr(0x30),chr(9)])
+    self.assertEquals(anim.getRepresentation()[4:],map(chr, [0x7e, 0x18, 0x3c, 0x7e, 0x7e, 0x3c, 0x18, 0x08, 0x81]))
+    anim = animationFrame(map(chr, range(1, 17)))
+    self.assertEquals(anim.getRepresentation()[0:2],[chr(0x20),chr(16)])
+
+  def test_intervalHeaderOK(self):
+    anim = animationFrame(map(chr, range(1, 9)),interval=300)
+    self.assertEquals(anim.getRepresentation()[0:2],[chr(0xa0),chr(10)])
+    self.assertEquals(anim.getRepresentation()[4:6],[chr(1),chr(44)])
+    text = textFrame("MUZ",interval=20)
+    self.assertEquals(text.getRepresentation()[0:2],[chr(0x90),chr(5)])
+
+  def test_grayscaleHeaderOK(self):
+    columns = [[(row + column) % 8 for row in range(8)] for column in range(8)]
+    planes = grayscalePlanes(columns, 3)
+    self.assertEquals(len(planes),24)
+    self.assertEquals(planes[0],chr(0xaa))
+    self.assertEquals(planes[16+7],chr(0xe1))
+    anim = animationFrame(planes,speed=7,delay=8,planes=3)
+    self.assertEquals(anim.getHeader(),[chr(3 << 4 | 7),chr(8)])
+    with self.assertRaises(Exception):
+      animationFrame(planes[0:16],planes=3)
+    # 4 planes are not supported by the firmware
+    self.assertEquals(animationFrame(planes,planes=4).planes,1)
+
 class TestText(unittest.TestCase):
 
   def test_speedDefault(self):
@@ -96,6 +125,55 @@ class TestText(unittest.TestCase):
     text = textFrame([],speed=7,delay=8,direction=1)
     self.assertEquals(text.getHeader(),[chr(7 << 4 | 8),chr(1 << 4 | 0)])
 
+class TestModem(unittest.TestCase):
+
+  def test_symbolLength(self):
+    m = modem(frequency=48000)
+    # 8 samples at 8MHz / 32 / 13 per block -> ~20 samples at 48kHz
+    self.assertEquals(len(m.bits[0][0]),40)
+    self.assertEquals(len(m.bits[1][1]),80)
+
+  def test_profile(self):
+    m = modem(frequency=48000, profile=modem.PROFILE_QUAD)
+    self.assertEquals(len(m.bits[0]),4)
+    self.assertEquals(len(m.bits[1][3]),120)
+    # 2 bits per symbol: 0x1b -> symbols 3, 2, 1, 0
+    m.hilo = 0
+    self.assertEquals(m.modemcode(0x1b),m.bits[1][3] + m.bits[0][2] + m.bits[1][1] + m.bits[0][0])
+    # the preamble still uses the standard profile
+    self.assertEquals(len(m.preambleBits[0][0]),40)
+
+  def test_modemDataParity(self):
+    m = modem(data=[chr(0x12),chr(0x34),chr(0x56)],parity=True)
+    data = m.generateModemData()[len(m.preamble):]
+    self.assertEquals(len(data),6)
+    self.assertEquals(ord(data[2]),m.hammingCalculateParity2416(0x12,0x34))
+    self.assertEquals(data[4],chr(0))
+
+  def test_preamble(self):
+    m = modem(data=[chr(0x12),chr(0x34)],parity=True)
+    self.assertEquals(m.generateModemData()[:3],[chr(0),chr(0),chr(0)])
+
+  def test_interleaveBlock(self):
+    m = modem()
+    data = [chr(0)] * 32
+    data[2] = chr(0x01) # codeword 1, first byte, bit 0
+    data[31] = chr(0x80) # codeword 15, second byte, bit 7
+    raw = m.interleaveBlock(data)
+    self.assertEquals(len(raw),48)
+    self.assertEquals(ord(raw[0]),0x02)
+    self.assertEquals(ord(raw[2*15+1]),0x80)
+
+  def test_reedSolomon(self):
+    m = modem(data=map(chr, range(40)),reedsolomon=True)
+    data = m.generateModemData()[len(m.preamble):]
+    self.assertEquals(len(data),72)
+    self.assertEquals(data[44:68],[chr(0)] * 24)
+    # every block is a multiple of the generator polynomial, so it has a
+    # root at a^0 (XOR of all bytes is zero)
+    for index in range(0, 72, 36):
+      self.assertEquals(reduce(lambda a, b: a ^ ord(b), data[index:index+36], 0),0)
+
 class TestBlinkenrocket(unittest.TestCase):
 
   def test_addFrameFail(self):
@@ -113,5 +191,71 @@ class TestBlinkenrocket(unittest.TestCase):
     expect = [chr(0x99),chr(0x99),chr(0xA9),chr(0xA9),chr(0x01 << 4), chr(4),chr(7 << 4 | 8),chr(1 << 4 | 0),'M','U','Z','Y',chr(0x84),chr(0x84)]
     self.assertEquals(br.getMessage(),expect)
 
+  def test_carousel(self):
+    br = blinkenrocket()
+    br.frames = []
+    br.addFrame(textFrame("MUZY"))
+    br.addFrame(textFrame("X" * 40))
+    total = 1 + 1 + 2
+    output = br.getCarousel(loops=2, session=0x42)
+    self.assertEquals(len(output),2 * 40 * total)
+    self.assertEquals(output[0:6],[chr(0xC3),chr(0x3C),chr(0),chr(total),chr(1),chr(0x42)])
+    self.assertEquals(output[6],chr(2))
+    # directory entries: page offset relative to the data pages, CRC
+    crc = br.crc16(br.frames[1].getRepresentation())
+    self.assertEquals(output[10:12],[chr(0),chr(0)])
+    self.assertEquals(output[14:18],[chr(1),chr(0),chr(crc & 0xff),chr(crc >> 8)])
+    self.assertEquals(output[42],chr(1))
+    self.assertEquals(output[46:50],br.frames[0].getRepresentation()[0:4])
+    crc = br.crc16(output[2:38])
+    self.assertEquals(output[38:40],[chr(crc & 0xff),chr(crc >> 8)])
+
+  def test_storageImageTooLarge(self):
+    br = blinkenrocket(eeprom_size=65536)
+    br.frames = []
+    for i in range(4):
+      br.addFrame(textFrame("X" * 3000))
+    # layout version 1 addresses 248 pages only, these need 4 * 94
+    self.assertRaises(RuntimeError,br.getStorageImage)
+    self.assertEquals(len(br.getEEPROMImage()),65536)
+
+  def test_eepromImageV3(self):
+    br = blinkenrocket(eeprom_size=8192)
+    br.frames = []
+    br.addFrame(textFrame("X" * 40))
+    br.addFrame(textFrame("MUZY"))
+    image = br.getEEPROMImage()
+    self.assertEquals(len(image),8192)
+    self.assertEquals(image[0],chr(2))
+    self.assertEquals(image[255],chr(3))
+    self.assertEquals(image[4:6],[chr(0),chr(0)])
+    self.assertEquals(image[8:10],[chr(2),chr(0)])
+    crc = br.crc16(textFrame("MUZY").getRepresentation())
+    self.assertEquals(image[10:12],[chr(crc & 0xff),chr(crc >> 8)])
+    self.assertEquals(image[506:508],[chr(3),chr(0)])
+    crc = br.crc16(image[4:12] + image[506:508] + [image[0],image[254]])
+    self.assertEquals(image[510:512],[chr(crc & 0xff),chr(crc >> 8)])
+    self.assertEquals(image[767],chr(0xff))
+    self.assertEquals(image[1024+64:1024+72],textFrame("MUZY").getRepresentation())
+
+  def test_editMessage(self):
+    br = blinkenrocket()
+    text = textFrame("MUZ")
+    output = br.getEditMessage([('delete', 2), ('replace', 0, text), ('append', text)])
+    self.assertEquals(output[0:8],[chr(0xA5),chr(0xA5),chr(0xA5),chr(0x5A),chr(0x96),chr(0x69),chr(0xD2),chr(2)])
+    self.assertEquals(output[8:12],[chr(0xE1),chr(0),chr(0x0f),chr(0xf0)])
+    self.assertEquals(output[12:19],text.getRepresentation())
+    self.assertEquals(output[19],chr(0))
+    self.assertEquals(output[20:22],[chr(0x0f),chr(0xf0)])
+    self.assertEquals(output[-3:],[chr(0x84)] * 3)
+
+  def test_brightnessMessage(self):
+    br = blinkenrocket()
+    br.frames = [textFrame("MUZ")]
+    output = br.getMessage(brightness=2)
+    self.assertEquals(output[3:8],[chr(0x5A),chr(0xB4),chr(2),chr(0x0f),chr(0xf0)])
+    output = br.getEditMessage([('brightness', 8)])
+    self.assertEquals(output[4:],[chr(0x96),chr(0x69),chr(0xB4),chr(8)] + [chr(0x84)] * 3)
+
 if __name__ == '__main__':
     unittest.main()